@@ -32,8 +32,28 @@
 
 #include <linux/hid.h>
 #include <linux/module.h>
-#include <linux/usb.h>
 #include <linux/hwmon.h>
+#include <linux/jiffies.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/completion.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+#include <linux/ktime.h>
+#include <linux/seqlock.h>
+#include <linux/seq_file.h>
+#include <linux/delay.h>
+#include <linux/dma-mapping.h>
+#include <asm/unaligned.h>
+#ifdef CORSAIRPSU_MOCK
+#include <linux/hrtimer.h>
+#endif
+
+#define CREATE_TRACE_POINTS
+#include "corsairpsu_trace.h"
 
 MODULE_DESCRIPTION("hwmon HID driver for the Corsair RMi and HXi series of PSUs");
 MODULE_AUTHOR("Benjamin Maisonnas");
@@ -42,47 +62,506 @@ MODULE_VERSION("0.1.7");
 
 #define USB_VENDOR_ID_CORSAIR	0x1b1c
 
-#define USB_MUTEX_LOCKED_ERR -99
-static DEFINE_MUTEX(usbdev_mutex);
+static unsigned int cache_timeout = 1000;
+module_param(cache_timeout, uint, 0644);
+MODULE_PARM_DESC(cache_timeout, "Time in ms a sensors snapshot is served before querying the PSU again (0 to disable)");
+
+static unsigned int slow_interval = 5000;
+module_param(slow_interval, uint, 0644);
+MODULE_PARM_DESC(slow_interval, "Time in ms between refreshes of slowly changing registers (temperatures, fan, uptimes)");
+
+static unsigned int cmd_timeout = 250;
+module_param(cmd_timeout, uint, 0644);
+MODULE_PARM_DESC(cmd_timeout, "Time in ms to wait for the PSU to answer a command");
+
+static unsigned int update_interval;
+module_param(update_interval, uint, 0444);
+MODULE_PARM_DESC(update_interval, "Initial period in ms of the background sampler (0 to read on demand)");
+
+static unsigned int ring_size = 1024;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "Number of samples kept for the debugfs samples file, 2 to 16384, rounded up to a power of 2");
+
+#define CORSAIRPSU_RING_MIN	2	// a kfifo needs a mask
+#define CORSAIRPSU_RING_MAX	16384	// about 1 MiB of samples, well within kmalloc
+
+static struct dentry *corsairpsu_debugfs;
+
+// the bound PSUs, for the aggregate of redundant supplies
+static LIST_HEAD(corsairpsu_registry);
+static DEFINE_MUTEX(corsairpsu_registry_lock);
+
+#define CORSAIRPSU_PIPELINE_MAX	8	// commands in flight, what the PSU is asked to queue
+
+static unsigned int pipeline_depth = 4;
+
+static int corsairpsu_set_pipeline_depth(const char *val, const struct kernel_param *kp) {
+	unsigned int depth;
+	int ret;
+
+	ret = kstrtouint(val, 0, &depth);
+	if (ret < 0) {
+		return ret;
+	}
+	if (depth < 1 || depth > CORSAIRPSU_PIPELINE_MAX) {
+		return -EINVAL;
+	}
+
+	return param_set_uint(val, kp);
+}
+
+static const struct kernel_param_ops pipeline_depth_ops = {
+	.set = corsairpsu_set_pipeline_depth,
+	.get = param_get_uint,
+};
+
+module_param_cb(pipeline_depth, &pipeline_depth_ops, &pipeline_depth, 0644);
+MODULE_PARM_DESC(pipeline_depth, "Number of commands of a batch sent ahead of their responses, 1 to 8 (1 to disable pipelining)");
+
+static unsigned int fan_write_delay = 200;
+module_param(fan_write_delay, uint, 0644);
+MODULE_PARM_DESC(fan_write_delay, "Time in ms fan writes are held for, only the last value is written to the PSU");
+
+#define CORSAIRPSU_RAILS	3	// 12v, 5v, 3.3v
+#define CORSAIRPSU_REPORT_SIZE	64	// input and output reports
+#define CORSAIRPSU_POWERS	(1 + CORSAIRPSU_RAILS)	// total, then the rails
+#define CORSAIRPSU_POWER_IN	CORSAIRPSU_POWERS	// power channel of the AC side, derived
+#define CORSAIRPSU_PAGE_UNKNOWN	-1
+#define CORSAIRPSU_LOCK_TIMEOUT	2000	// ms, longest a reader waits for a sweep in progress
+#define CORSAIRPSU_DRAIN_QUIET	5	// ms without input report for stale ones to be drained
+
+// a command of a batch and its outcome
+struct corsairpsu_cmd {
+	u8 addr;
+	u8 opcode;
+	u8 opdata;
+	void *dst;				// response data, can be NULL
+	size_t len;
+	int status;				// -ENODATA if the PSU answered another opcode
+	ktime_t sent;				// for the latency stats
+};
+
+#define CORSAIRPSU_HIST_BUCKETS	20
+
+// log2 histogram of durations, bucket 0 for < 1 us then [2^(i-1), 2^i) us
+struct corsairpsu_hist {
+	atomic_t buckets[CORSAIRPSU_HIST_BUCKETS];
+};
+
+struct corsairpsu_opcode_stats {
+	atomic_long_t count;			// commands sent
+	atomic_long_t errors;			// answered with another opcode or timed out
+	atomic_long_t retries;			// recoveries
+	struct corsairpsu_hist latency;		// from send to response
+};
+
+/*
+	Hot path statistics, shown and reset in debugfs corsairpsu/<device>/stats
+
+	Atomics only, they are updated from raw_event and by unlocked readers.
+*/
+struct corsairpsu_stats {
+	atomic_long_t cache_hits;		// snapshot served without a sweep
+	atomic_long_t cache_coalesced;		// snapshot of a sweep waited for
+	atomic_long_t cache_misses;		// sweep done for the reader
+	atomic_long_t lock_waits;
+	atomic64_t lock_wait_ns;
+	struct corsairpsu_hist lock_wait;
+	struct corsairpsu_hist sweep;		// duration of the sweeps
+	struct corsairpsu_opcode_stats opcodes[256];
+	atomic_long_t fan_writes;		// sent to the PSU
+	atomic_long_t fan_writes_coalesced;	// replaced by a later one before being sent
+	atomic_long_t fan_writes_skipped;	// the PSU already had the value
+};
+
+// the fan settings userspace writes, through pwm1_enable and pwm1
+enum corsairpsu_fan_write {
+	CORSAIRPSU_FAN_MODE,			// 0 (hardware) or 1 (software)
+	CORSAIRPSU_FAN_PWM,			// percent
+	CORSAIRPSU_FAN_WRITES,
+};
+
+// a point of the fan curve, applied by the sampler, in between they are interpolated
+#define CORSAIRPSU_CURVE_POINTS	8
+#define CORSAIRPSU_CURVE_TEMP_MIN	-40000	// millidegree Celsius
+#define CORSAIRPSU_CURVE_TEMP_MAX	150000
+
+struct corsairpsu_curve_point {
+	long temp;				// millidegree Celsius
+	long pwm;				// 0-255
+};
+
+/*
+	Register refresh classes, each one has its own schedule
+	- fast: every sweep, when the cache expires or the sampler runs
+	- slow: at most every slow_interval ms
+	- static: never change at runtime, read once at probe
+*/
+enum corsairpsu_class {
+	CORSAIRPSU_FAST,
+	CORSAIRPSU_SLOW,
+	CORSAIRPSU_STATIC,
+	CORSAIRPSU_NUM_CLASSES,
+};
+
+#define CORSAIRPSU_ALL_CLASSES	GENMASK(CORSAIRPSU_NUM_CLASSES - 1, 0)
+
+// every register read by a sweep, indexes corsairpsu_regs[] and the snapshot
+enum corsairpsu_reg_id {
+	CORSAIRPSU_REG_TEMP1,
+	CORSAIRPSU_REG_TEMP2,
+	CORSAIRPSU_REG_TEMP_MAX,
+	CORSAIRPSU_REG_FAN,
+	CORSAIRPSU_REG_IN_SUPPLY,
+	CORSAIRPSU_REG_POWER_TOTAL,
+	CORSAIRPSU_REG_CURR_SUPPLY,
+	CORSAIRPSU_REG_TOTAL_UPTIME,
+	CORSAIRPSU_REG_CURRENT_UPTIME,
+	CORSAIRPSU_REG_OCP_MODE,
+	CORSAIRPSU_REG_FAN_CONTROL,
+	CORSAIRPSU_REG_FAN_PWM,
+	CORSAIRPSU_REG_STATUS_TEMP,
+	CORSAIRPSU_REG_STATUS_CML,
+	CORSAIRPSU_REG_STATUS_FANS,
+	// then one per rail, 12v, 5v, 3.3v
+	CORSAIRPSU_REG_IN_RAIL,
+	CORSAIRPSU_REG_IN_MAX = CORSAIRPSU_REG_IN_RAIL + CORSAIRPSU_RAILS,
+	CORSAIRPSU_REG_IN_MIN = CORSAIRPSU_REG_IN_MAX + CORSAIRPSU_RAILS,
+	CORSAIRPSU_REG_CURR = CORSAIRPSU_REG_IN_MIN + CORSAIRPSU_RAILS,
+	CORSAIRPSU_REG_CURR_MAX = CORSAIRPSU_REG_CURR + CORSAIRPSU_RAILS,
+	CORSAIRPSU_REG_POWER_RAIL = CORSAIRPSU_REG_CURR_MAX + CORSAIRPSU_RAILS,
+	CORSAIRPSU_REG_STATUS_WORD = CORSAIRPSU_REG_POWER_RAIL + CORSAIRPSU_RAILS,
+	CORSAIRPSU_NUM_REGS = CORSAIRPSU_REG_STATUS_WORD + CORSAIRPSU_RAILS,
+};
+
+/*
+	Running statistics of a power channel, integrated from sweep to sweep
+
+	energy is never reset, the others restart at the last reset_history.
+*/
+struct corsairpsu_power_stats {
+	u64 energy;				// uJ
+	u32 energy_rem;				// nJ, remainder not in energy yet
+	long highest;				// uW
+	long lowest;				// uW
+	u64 reset_energy;			// energy at the last reset_history
+	s64 reset_timestamp;			// ns, time of the last reset_history
+};
+
+#define CORSAIRPSU_WINDOW	64	// power readings kept for the averaging windows
+
+// the power readings of a sweep, in the averaging window
+struct corsairpsu_window_sample {
+	s64 timestamp;				// ns, snapshot timestamp
+	long power[CORSAIRPSU_POWERS];		// uW
+};
+
+// averaging window of a power channel, over the shared window samples
+struct corsairpsu_window {
+	unsigned int interval;			// ms, 0 to average since the last reset_history
+	unsigned int tail;			// oldest sample in the window
+	unsigned int count;
+	s64 sum;				// uW, of the samples in the window
+};
+
+/*
+	Recovery from a command answered with another opcode, in escalation order
+
+	- resync: wait for stale input reports (late responses, other hidraw users)
+	  to drain, then retry
+	- handshake: handshake, select the rail again, then retry
+*/
+enum corsairpsu_recovery {
+	CORSAIRPSU_RECOVER_RESYNC,
+	CORSAIRPSU_RECOVER_HANDSHAKE,
+};
+
+// transport error counters, shown in debugfs corsairpsu/<device>/errors
+struct corsairpsu_errors {
+	unsigned long mismatches;		// responses with another opcode
+	unsigned long stale;			// reports while no command was waiting
+	unsigned long timeouts;
+	unsigned long send_errors;
+	unsigned long resyncs;			// resync recoveries attempted
+	unsigned long handshakes;		// handshake recoveries attempted
+	unsigned long recovered;		// commands that succeeded after a recovery
+	unsigned long unrecovered;		// commands still failing after a handshake
+};
+
+// all the readings of a single sweep, for every attribute
+struct corsairpsu_snapshot {
+	s64 timestamp;				// ns, CLOCK_MONOTONIC, end of the sweep
+	long values[CORSAIRPSU_NUM_REGS];	// decoded, in hwmon units
+	struct corsairpsu_power_stats power[CORSAIRPSU_POWERS];
+	// derived from the values once per sweep
+	long power_in;				// AC side, microwatt
+	long efficiency;			// rails over AC side, thousandths, -1 if unknown
+};
+
+/*
+	Binary record of the samples ring, read from debugfs corsairpsu/<device>/samples
+
+	Values use the hwmon units, bit n of valid is set if the n-th value is.
+*/
+struct corsairpsu_sample {
+	__s64 timestamp;			// ns, CLOCK_MONOTONIC
+	__s32 in[1 + CORSAIRPSU_RAILS];		// bits 0-3
+	__s32 curr[CORSAIRPSU_RAILS];		// bits 4-6
+	__s32 power[1 + CORSAIRPSU_RAILS];	// bits 7-10
+	__s32 temp[2];				// bits 11-12
+	__s32 fan;				// bit 13
+	__s32 curr_supply;			// bit 14, input current
+	__u32 valid;
+} __packed;
+
+/*
+	Binary record of the snapshot attribute, all the readings of one sweep
+
+	Values use the hwmon units. Fields are only ever appended, bumping version,
+	so readers can check version and size before using a record.
+*/
+#define CORSAIRPSU_RECORD_VERSION	2
+
+struct corsairpsu_record {
+	__u32 version;
+	__u32 size;				// of the whole record
+	__s64 timestamp;			// ns, CLOCK_MONOTONIC
+	__s64 temp[2];
+	__s64 temp_max;
+	__s64 fan;
+	__s64 in[1 + CORSAIRPSU_RAILS];
+	__s64 in_min[CORSAIRPSU_RAILS];
+	__s64 in_max[CORSAIRPSU_RAILS];
+	__s64 curr[CORSAIRPSU_RAILS];
+	__s64 curr_max[CORSAIRPSU_RAILS];
+	__s64 power[1 + CORSAIRPSU_RAILS];
+	__u32 total_uptime;
+	__u32 current_uptime;
+	__u32 ocp_mode;
+	__u32 fan_control;
+	// version 2
+	__s64 curr_supply;			// input current, 0 if not answered
+	__s64 power_in;				// AC side, 0 if unknown
+	__s64 efficiency;			// thousandths, -1 if unknown
+	__u32 pwm;				// 0-255
+} __packed;
+
+/*
+	Raw PMBus reads of debugfs corsairpsu/<device>/pmbus
+
+	Write a vector of struct corsairpsu_pmbus_read, then read back, in the same
+	order, a struct corsairpsu_pmbus_result for each, followed by its len bytes
+	(zeroed if status is an error).
+*/
+#define CORSAIRPSU_PMBUS_MAX_READS	64
+#define CORSAIRPSU_PMBUS_MAX_LEN	(CORSAIRPSU_REPORT_SIZE - 2)
+
+struct corsairpsu_pmbus_read {
+	__s8 page;				// rail, -1 for whatever is selected
+	__u8 opcode;
+	__u8 len;				// 1 to CORSAIRPSU_PMBUS_MAX_LEN
+	__u8 reserved;
+} __packed;
+
+struct corsairpsu_pmbus_result {
+	__s8 page;
+	__u8 opcode;
+	__u8 len;
+	__u8 reserved;
+	__s32 status;				// 0, or -errno
+} __packed;
+
+#ifdef CORSAIRPSU_MOCK
+// last run of the debugfs bench file
+struct corsairpsu_bench {
+	struct mutex lock;			// one run at a time, protects the results
+	unsigned int readers;
+	unsigned int iterations;
+	s64 duration;				// in ns
+	unsigned long reads, errors;
+	unsigned long sweeps, round_trips, lock_waits;
+	s64 min, max, total;			// read latency in ns
+};
+#endif
 
 struct corsairpsu_data {
-	struct usb_device *usbdev;
-	char *buf;
+	struct hid_device *hdev;
+	struct device *hwmon_dev;
+	struct mutex usb_mutex;			// one command at a time on this PSU, protects tx
+	u8 *tx;					// output report, zeroed past the command
+
+	spinlock_t rx_lock;			// protects rx_* against raw_event
+	struct corsairpsu_cmd *rx_cmds;		// batch in flight, NULL if none
+	unsigned int rx_head;			// next command to get a response
+	unsigned int rx_tail;			// number of commands sent
+	struct completion rx_done;		// completed once per response
+	int page;				// selected rail, or CORSAIRPSU_PAGE_UNKNOWN
+	enum corsairpsu_recovery recovery;	// level to start the next recovery at
+	struct corsairpsu_errors errors;	// rx_lock for the raw_event ones
+	struct corsairpsu_stats *stats;
+	s8 vout_exponent[CORSAIRPSU_RAILS];	// LINEAR16 exponent from VOUT_MODE, per rail
+	bool vout_linear16[CORSAIRPSU_RAILS];	// false to decode vout as LINEAR11
+	DECLARE_BITMAP(supported, CORSAIRPSU_NUM_REGS);	// registers the PSU answers, from probe
+
+	char vendor[32];			// identity, read once at probe
+	char product[32];
+	struct work_struct probe_work;		// identification, discovery and static registers
+	bool ready;				// once probe_work is done
+
+	struct mutex update_lock;		// protects the fields below
+	seqcount_mutex_t snapshot_seq;	// lockless reads of snapshot, written under update_lock
+	wait_queue_head_t update_wait;		// readers waiting on update_lock
+	unsigned long generation;		// number of successful sweeps
+	bool valid;				// false until the first sweep succeeds
+	unsigned long last_updated;		// in jiffies
+	unsigned long class_updated[CORSAIRPSU_NUM_CLASSES];	// in jiffies
+	unsigned int classes_loaded;		// mask of the classes read at least once
+	struct corsairpsu_snapshot snapshot;
+	struct corsairpsu_cmd sweep_cmds[CORSAIRPSU_NUM_REGS];
+	u8 sweep_raw[CORSAIRPSU_NUM_REGS][4];
+
+	// power averaging, updated with the snapshot
+	struct corsairpsu_window_sample window[CORSAIRPSU_WINDOW];
+	unsigned int window_head;		// next sample to write
+	struct corsairpsu_window windows[CORSAIRPSU_POWERS];
+
+	unsigned int update_interval;		// sampler period in ms, 0 if stopped
+	struct delayed_work sample_work;
+
+	int fan_request[CORSAIRPSU_FAN_WRITES];	// update_lock, value to write or -1
+	struct delayed_work fan_work;		// writes them fan_write_delay ms after the first
+	struct corsairpsu_curve_point fan_curve[CORSAIRPSU_CURVE_POINTS];	// update_lock
+	unsigned int fan_curve_points;		// 0 when userspace drives the fan
+
+	struct dentry *debugfs;
+	DECLARE_KFIFO_PTR(ring, struct corsairpsu_sample);	// filled by the sampler only
+	struct mutex ring_read_lock;		// one reader drains the ring at a time
+	wait_queue_head_t ring_wait;
+	unsigned long ring_dropped;		// samples lost to a full ring
+	bool removing;				// set under update_lock, no work is queued once set
+
+	struct list_head registry;		// in corsairpsu_registry once identified
+	struct work_struct aggregate_work;	// refreshes the snapshot for the aggregate
+	int aggregate_ret;
+#ifdef CORSAIRPSU_MOCK
+	struct corsairpsu_bench bench;
+#endif
 };
 
 /*
-	Send a command and get its output
-	- write using interrupt to endpoint 0x01
-	- read using interrupt from endpoint 0x82
+	Send a batch of commands and get their output
+	- write as output reports through the HID core, up to pipeline_depth ahead
+	- the responses are input reports, matched in order by corsairpsu_raw_event()
+	  and copied to the dst of their command under rx_lock, no buffer is shared
+	  with the next batch, so callers decode them under their own lock
+
+	Returns an error if the transport failed, each command has its own status.
 */
-static int usb_send_recv_cmd(struct corsairpsu_data* data) {
-	int ret, actual_length;
+static void corsairpsu_hist_add(struct corsairpsu_hist *hist, ktime_t delta) {
+	s64 us = ktime_to_us(delta);
+	int bucket = us > 0 ? min(fls64(us), CORSAIRPSU_HIST_BUCKETS - 1) : 0;
 
-	ret = mutex_trylock(&usbdev_mutex);
-	if (ret == 0) {
-		return USB_MUTEX_LOCKED_ERR;
-	}
+	atomic_inc(&hist->buckets[bucket]);
+}
 
-	ret = usb_interrupt_msg(data->usbdev, usb_sndintpipe(data->usbdev, 0x01),
-				data->buf, 64, &actual_length,
-				USB_CTRL_SET_TIMEOUT);
-	if (ret < 0) {
-		dev_err(&data->usbdev->dev, "Failed to send HID Request (error %d)\n", ret);
-		mutex_unlock(&usbdev_mutex);
-		return ret;
-	}
+static int usb_send_recv_batch(struct corsairpsu_data* data, struct corsairpsu_cmd *cmds,
+				unsigned int count) {
+	unsigned int depth = clamp_val(READ_ONCE(pipeline_depth), 1, CORSAIRPSU_PIPELINE_MAX);
+	unsigned int sent = 0, done = 0;
+	unsigned long flags;
+	int ret = 0;
+
+	mutex_lock(&data->usb_mutex);
+
+	reinit_completion(&data->rx_done);
+	spin_lock_irqsave(&data->rx_lock, flags);
+	data->rx_cmds = cmds;
+	data->rx_head = 0;
+	data->rx_tail = 0;
+	spin_unlock_irqrestore(&data->rx_lock, flags);
+
+	while (done < count) {
+		if (sent < count && sent - done < depth) {
+			// the sends are synchronous, the report is free again once one returns
+			data->tx[0] = cmds[sent].addr;
+			data->tx[1] = cmds[sent].opcode;
+			data->tx[2] = cmds[sent].opdata;
+			cmds[sent].status = -ETIMEDOUT;
+			cmds[sent].sent = ktime_get();
+			atomic_long_inc(&data->stats->opcodes[cmds[sent].opcode].count);
+			trace_corsairpsu_cmd_start(data->hdev, cmds[sent].addr, cmds[sent].opcode,
+						   data->page);
+
+			spin_lock_irqsave(&data->rx_lock, flags);
+			data->rx_tail++;
+			spin_unlock_irqrestore(&data->rx_lock, flags);
+
+			// the transport ops are the HID low level driver, see corsairpsu_mock_ll_driver
+			ret = hid_hw_output_report(data->hdev, data->tx, CORSAIRPSU_REPORT_SIZE);
+			if (ret < 0) {
+				hid_err(data->hdev, "Failed to send HID Request (error %d)\n", ret);
+				data->errors.send_errors++;
+				break;
+			}
+			ret = 0;
+			sent++;
+			continue;
+		}
 
-	memset(data->buf, 0, 64);
-	ret = usb_interrupt_msg(data->usbdev, usb_rcvintpipe(data->usbdev, 0x81),
-				data->buf, 64, &actual_length,
-				USB_CTRL_SET_TIMEOUT);
-	if (ret < 0) {
-		dev_err(&data->usbdev->dev, "Failed to get HID Response (error: %d).\n", ret);
-		mutex_unlock(&usbdev_mutex);
-		return ret;
+		if (wait_for_completion_timeout(&data->rx_done, msecs_to_jiffies(cmd_timeout)) == 0) {
+			ret = -ETIMEDOUT;
+			hid_err(data->hdev, "Failed to get HID Response (error: %d).\n", ret);
+			data->errors.timeouts++;
+			atomic_long_inc(&data->stats->opcodes[cmds[done].opcode].errors);
+			trace_corsairpsu_cmd_done(data->hdev, cmds[done].opcode, data->page,
+						  ktime_to_ns(ktime_sub(ktime_get(), cmds[done].sent)),
+						  -ETIMEDOUT);
+			break;
+		}
+		done++;
 	}
 
-	mutex_unlock(&usbdev_mutex);
+	spin_lock_irqsave(&data->rx_lock, flags);
+	data->rx_cmds = NULL;
+	spin_unlock_irqrestore(&data->rx_lock, flags);
+
+	mutex_unlock(&data->usb_mutex);
+
+	return ret;
+}
+
+// input reports, including the responses to our commands
+static int corsairpsu_raw_event(struct hid_device *dev, struct hid_report *report,
+				u8 *raw, int size) {
+	struct corsairpsu_data *data = hid_get_drvdata(dev);
+	struct corsairpsu_cmd *cmd;
+	unsigned long flags;
+	ktime_t latency;
+
+	spin_lock_irqsave(&data->rx_lock, flags);
+	// anything arriving while no command is waiting is a stale report
+	if (data->rx_cmds != NULL && data->rx_head < data->rx_tail) {
+		cmd = &data->rx_cmds[data->rx_head++];
+		latency = ktime_sub(ktime_get(), cmd->sent);
+		// the PSU echoes the opcode of the command it answers
+		if (size < 2 || raw[1] != cmd->opcode) {
+			cmd->status = -ENODATA;
+			data->errors.mismatches++;
+			atomic_long_inc(&data->stats->opcodes[cmd->opcode].errors);
+		} else {
+			if (cmd->dst != NULL && cmd->len > 0) {
+				memcpy(cmd->dst, raw + 2, min_t(size_t, cmd->len, size - 2));
+			}
+			cmd->status = 0;
+			corsairpsu_hist_add(&data->stats->opcodes[cmd->opcode].latency, latency);
+		}
+		trace_corsairpsu_cmd_done(dev, cmd->opcode, data->page, ktime_to_ns(latency),
+					  cmd->status);
+		complete(&data->rx_done);
+	} else {
+		data->errors.stale++;
+	}
+	spin_unlock_irqrestore(&data->rx_lock, flags);
 
 	return 0;
 }
@@ -94,13 +573,16 @@ static int usb_send_recv_cmd(struct corsairpsu_data* data) {
 	---              ---     ---     ---
 	name             0xFE    0x03    'RM650i'
 	vendor           0x03    0x99    'CORSAIR'
+	vout mode        0x03    0x20    0x00 (per rail, linear exponent in bits 0-4)
 	product          0x03    0x9A    'RM650i'
 	temp1            0x03    0x8D    46.2
 	temp2            0x03    0x8E    39.0
 	temp_limit       0x03    0x4f    70.0    
 	fan rpm          0x03    0x90    0.0
 	fan control      0x03    0xF0    0 (hardware) or 1 (software)
+	fan pwm          0x03    0x3B    40 (percent, used in software mode)
 	voltage supply   0x03    0x88    230.0
+	current supply   0x03    0x89    0.6 (READ_IIN, not on every model)
 	power total      0x03    0xEE    82.0
 	voltage 12v      0x03    0x8B    12.1
  	12v OV fault	 0x03	 0x40	 15.59
@@ -123,69 +605,201 @@ static int usb_send_recv_cmd(struct corsairpsu_data* data) {
 	total uptime     0x03    0xD1    23160895
 	uptime           0x03    0xD2    41695
 	ocp mode         0x03    0xD8    1 (mono rail) or 2 (multi rail)
+	status word      0x03    0x79    0x0000 (per rail)
+	status temp      0x03    0x7D    0x00
+	status comms     0x03    0x7E    0x00
+	status fans      0x03    0x81    0x00
 
 	select one of the three rails with 0x02, 0x00, [0x00|0x01|0x02]
+	write the fan control or pwm with 0x02, [0xF0|0x3B], value
 
 	TODO
 
 	fan mode         0x03    0x3A    TODO
-	fan pwm          0x03    0x3B    TODO
-	fan status       0x03    0x81    TODO
  	"blackbox mode"	 0x03	 0xd9	 TODO what does this even do?
  	"setting reset"  0x03	 0xdd 0x01
  	determine max wattage based on model name?
- 	report status registers (temp @ 0x7d, comms @ 0x7e, fans @ 0x81)
 */
 
 static int send_recv_cmd_impl(struct corsairpsu_data* data, u8 addr, u8 opcode, u8 opdata,
 			 void *result, size_t result_size) {
+	struct corsairpsu_cmd cmd = {
+		.addr = addr,
+		.opcode = opcode,
+		.opdata = opdata,
+		.dst = result,
+		.len = result_size,
+	};
 	int ret;
 
-	memset(data->buf, 0, 64);
-	data->buf[0] = addr;
-	data->buf[1] = opcode;
-	data->buf[2] = opdata;
-
-	ret = usb_send_recv_cmd(data);
+	ret = usb_send_recv_batch(data, &cmd, 1);
 	if (ret < 0) {
 		return ret;
 	}
 
-	return 0;
+	return cmd.status;
+}
+
+static int send_recv_handshake(struct corsairpsu_data* data) {
+	//handshaking may reset the PSU state, including the selected rail
+	data->page = CORSAIRPSU_PAGE_UNKNOWN;
+	return send_recv_cmd_impl(data, 0xfe, 0x03, 0x00, NULL, 0);
 }
 
+/*
+	Select one of the three rails (PMBus page)
+
+	The currently selected page is remembered so consecutive reads of the
+	same rail only pay for a single select.
+*/
 static int send_recv_cmd(struct corsairpsu_data* data, u8 addr, u8 opcode, u8 opdata,
-							void *result, size_t result_size) {
+							void *result, size_t result_size);
+
+static int select_page(struct corsairpsu_data* data, u8 page) {
 	int ret;
 
-	ret = send_recv_cmd_impl(data, addr, opcode, opdata, result, result_size);
+	if (data->page == page) {
+		return 0;
+	}
+
+	ret = send_recv_cmd(data, 0x02, 0x00, page, NULL, 0);
 	if (ret < 0) {
+		data->page = CORSAIRPSU_PAGE_UNKNOWN;
 		return ret;
 	}
-	if( (data->buf[1] & 0xff) != (opcode & 0xff)) {
-		//we got an error response from the PSU. Try handshaking again:
-		ret = send_recv_cmd_impl(data, 0xfe, 0x03, 0x00, NULL, 0);
-		if(ret < 0) {
-			return ret;
+	data->page = page;
+
+	return 0;
+}
+
+// wait until no stale input report arrived for CORSAIRPSU_DRAIN_QUIET, at most cmd_timeout
+static void corsairpsu_drain(struct corsairpsu_data* data) {
+	unsigned long deadline = jiffies + msecs_to_jiffies(cmd_timeout);
+	unsigned long stale;
+
+	do {
+		stale = READ_ONCE(data->errors.stale);
+		msleep(CORSAIRPSU_DRAIN_QUIET);
+	} while (READ_ONCE(data->errors.stale) != stale && time_before(jiffies, deadline));
+}
+
+/*
+	Retry a command answered with another opcode, escalating from resync to
+	handshake. The recovery starts at the level that last worked, so a PSU
+	that lost its state doesn't pay for a useless resync every time. Stale
+	reports are drained and the handshake is done at most once per batch.
+
+	Returns an error if the transport failed, the command status otherwise.
+*/
+static int corsairpsu_recover(struct corsairpsu_data* data, int page, struct corsairpsu_cmd *cmd,
+			      bool *drained, bool *handshaken) {
+	enum corsairpsu_recovery level;
+	int ret;
+
+	atomic_long_inc(&data->stats->opcodes[cmd->opcode].retries);
+
+	for (level = data->recovery; level <= CORSAIRPSU_RECOVER_HANDSHAKE; level++) {
+		trace_corsairpsu_handshake_retry(data->hdev, cmd->opcode, page, level);
+		if (level == CORSAIRPSU_RECOVER_RESYNC && !*drained) {
+			data->errors.resyncs++;
+			corsairpsu_drain(data);
+			*drained = true;
+		} else if (level == CORSAIRPSU_RECOVER_HANDSHAKE && !*handshaken) {
+			data->errors.handshakes++;
+			ret = send_recv_handshake(data);
+			if (ret < 0) {
+				return ret;
+			}
+			*handshaken = true;
+		}
+		if (page != CORSAIRPSU_PAGE_UNKNOWN) {
+			ret = select_page(data, page);
+			if (ret < 0) {
+				return ret;
+			}
 		}
-		//we got a good handshake. retry the original command:
-		ret = send_recv_cmd_impl(data, addr, opcode, opdata, result, result_size);
+
+		cmd->status = send_recv_cmd_impl(data, cmd->addr, cmd->opcode, cmd->opdata,
+						 cmd->dst, cmd->len);
+		if (cmd->status != -ENODATA) {
+			if (cmd->status == 0) {
+				data->errors.recovered++;
+			}
+			data->recovery = level;
+			return cmd->status;
+		}
+	}
+
+	//still answered with another opcode after a handshake, it really was an error
+	data->errors.unrecovered++;
+	data->recovery = CORSAIRPSU_RECOVER_RESYNC;
+
+	return cmd->status;
+}
+
+/*
+	Send/receive a batch of commands helper
+
+	The commands are pipelined and all run on the given rail, or whatever rail
+	is selected for CORSAIRPSU_PAGE_UNKNOWN, so they must not select a rail
+	themselves. Commands answered with another opcode are retried one by one
+	through corsairpsu_recover(). Returns the first error of the batch.
+*/
+static int send_recv_batch(struct corsairpsu_data* data, int page, struct corsairpsu_cmd *cmds,
+							unsigned int count) {
+	bool drained = false, handshaken = false;
+	unsigned int i;
+	int ret;
+
+	if (page != CORSAIRPSU_PAGE_UNKNOWN) {
+		ret = select_page(data, page);
 		if (ret < 0) {
 			return ret;
 		}
-		if(data->buf[1] != opcode) {
-			//well, looks like it really was an error.
-			return -ENODATA;
+	}
+
+	ret = usb_send_recv_batch(data, cmds, count);
+	if (ret < 0) {
+		return ret;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (cmds[i].status != -ENODATA) {
+			continue;
+		}
+		ret = corsairpsu_recover(data, page, &cmds[i], &drained, &handshaken);
+		if (ret < 0 && ret != -ENODATA) {
+			return ret;
 		}
-		//success! fall down to the next block & copy the data out.
 	}
-	if (result != NULL && result_size > 0) {
-		memcpy(result, data->buf + 2, result_size);
+
+	// a clean batch, the next recovery can try the cheap way first
+	if (!drained && !handshaken) {
+		data->recovery = CORSAIRPSU_RECOVER_RESYNC;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (cmds[i].status < 0) {
+			return cmds[i].status;
+		}
 	}
 
 	return 0;
 }
 
+static int send_recv_cmd(struct corsairpsu_data* data, u8 addr, u8 opcode, u8 opdata,
+							void *result, size_t result_size) {
+	struct corsairpsu_cmd cmd = {
+		.addr = addr,
+		.opcode = opcode,
+		.opdata = opdata,
+		.dst = result,
+		.len = result_size,
+	};
+
+	return send_recv_batch(data, CORSAIRPSU_PAGE_UNKNOWN, &cmd, 1);
+}
+
 /*
 	LINEAR11 format is used for non-output voltage (See PMBusPart II, Section 7.3)
 
@@ -200,408 +814,1760 @@ static int send_recv_cmd(struct corsairpsu_data* data, u8 addr, u8 opcode, u8 op
 
 	https://github.com/torvalds/linux/blob/v5.5/drivers/hwmon/pmbus/pmbus_core.c#L612
 */
-static long pmbus_linear11_to_long(u16 v16, int scale) {
+static inline long pmbus_linear_to_long(long mantissa, int exponent, int scale) {
+	long val = mantissa * scale;
+
+	// scale before shifting, so negative exponents keep their precision
+	if (exponent >= 0)
+		return val * (1L << exponent);
+	else
+		return val >> -exponent;
+}
+
+static inline long pmbus_linear11_to_long(u16 v16, int scale) {
 	s16 exponent;
 	s32 mantissa;
-	long val;
 
 	exponent = ((s16)v16) >> 11;
 	mantissa = ((s16)((v16 & 0x7ff) << 5)) >> 5;
-	val = mantissa * scale;
 
-	if (exponent >= 0)
-		val <<= exponent;
-	else
-		val >>= -exponent;
+	return pmbus_linear_to_long(mantissa, exponent, scale);
+}
+
+/*
+	LINEAR16 format is used for output voltages (See PMBusPart II, Section 8.3.1)
+
+	X = V ∙ 2N
 
-	return val;
+	Where:
+	– V is an unsigned 16 bit integer, the register value
+	– N is a signed 5 bit 2’s complement integer, from VOUT_MODE (0x20)
+*/
+static inline long pmbus_linear16_to_long(u16 v16, int exponent, int scale) {
+	return pmbus_linear_to_long(v16, exponent, scale);
 }
 
-static int corsairpsu_read(struct device *dev, enum hwmon_sensor_types type,
-							u32 attr, int channel, long *val) {
+static long pmbus_u32_to_long(const u8 *raw) {
+	return get_unaligned_le32(raw);
+}
 
-	struct corsairpsu_data *data = dev_get_drvdata(dev);
-	u16 reading;
-	int ret;
+/*
+	VOUT_MODE, mode in the 3 upper bits and parameter in the 5 lower ones
 
-	switch (type) {
-		// Chip
-		case hwmon_chip:
-			switch (attr) {
-				case hwmon_chip:
-					switch (channel) {
-						case 0: // temp1
-							ret = send_recv_cmd(data, 0x03, 0x8D, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000L);
-							break;
-						default:
-							return -EOPNOTSUPP;
-					}
-					break;
-				default:
-					return -EOPNOTSUPP;
-			}
-			break;
+	Only the linear mode (0) is decoded, with the parameter as exponent.
+*/
+#define PMBUS_VOUT_MODE			0x20
+#define PMBUS_VOUT_MODE_LINEAR		0x00
+#define PMBUS_VOUT_MODE_MASK		0xe0
+
+// register value formats
+enum corsairpsu_format {
+	CORSAIRPSU_LINEAR11,			// 2 bytes, see pmbus_linear11_to_long()
+	CORSAIRPSU_VOUT,			// 2 bytes, LINEAR16 if VOUT_MODE is linear, else LINEAR11
+	CORSAIRPSU_U32,				// 4 bytes, little endian
+	CORSAIRPSU_U16,				// 2 bytes, little endian, status word
+	CORSAIRPSU_U8,				// 1 byte, status registers
+};
 
-		// Temperatures (millidegree Celsius)
-		case hwmon_temp:
-			switch (attr) {
-				case hwmon_temp_input:
-					switch (channel) {
-						case 0: // temp1
-							ret = send_recv_cmd(data, 0x03, 0x8D, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000L);
-							break;
-						case 1: // temp2
-							ret = send_recv_cmd(data, 0x03, 0x8E, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000L);
-							break;
-						default:
-							return -EOPNOTSUPP;
-					}
-					break;
-				case hwmon_temp_max: //TODO: for kernel 5.10, use case hwmon_temp_rated_max:
-					switch(channel) {
-						case 0:
-						case 1:
-							ret = send_recv_cmd(data, 0x03, 0x4F, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000L);
-							break;
-						default:
-							return -EOPNOTSUPP;
-					}
-					break;
-				default:
-					return -EOPNOTSUPP;
-			}
-			break;
+/*
+	Register map, a register per hwmon attribute or custom attribute
 
-		// Fan (RPM)
-		case hwmon_fan:
-			switch (attr) {
-				case hwmon_fan_input:
-					switch (channel) {
-						case 0: // fan rpm
-							ret = send_recv_cmd(data, 0x03, 0x90, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 0L);
-							break;
-						default:
-							return -EOPNOTSUPP;
-					}
-					break;
-				default:
-					return -EOPNOTSUPP;
-			}
-			break;
+	Everything else (read path, sweep batches, is_visible) is generated from it.
+*/
+struct corsairpsu_reg {
+	enum hwmon_sensor_types type;		// hwmon_max for custom attributes
+	u32 attr;
+	int channel;				// -1 for every channel of type
+	int page;				// rail, CORSAIRPSU_PAGE_UNKNOWN for the whole PSU
+	u8 opcode;
+	enum corsairpsu_format format;
+	int scale;
+	enum corsairpsu_class class;
+};
 
-		// Voltage (millivolt)
-		case hwmon_in:
-			switch (attr) {
-				case hwmon_in_input:
-					switch (channel) {
-						case 0: // voltage supply
-							ret = send_recv_cmd(data, 0x03, 0x88, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000L);
-							break;
-						case 1: // voltage 12v
-							ret = send_recv_cmd(data, 0x02, 0x00, 0x00, NULL, 0);
-							if (ret < 0) {
-								goto err;
-							}
-							ret = send_recv_cmd(data, 0x03, 0x8B, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000L);
-							break;
-						case 2: // voltage 5v
-							ret = send_recv_cmd(data, 0x02, 0x00, 0x01, NULL, 0);
-							if (ret < 0) {
-								goto err;
-							}
-							ret = send_recv_cmd(data, 0x03, 0x8B, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000L);
-							break;
-						case 3: // voltage 3.3v
-							ret = send_recv_cmd(data, 0x02, 0x00, 0x02, NULL, 0);
-							if (ret < 0) {
-								goto err;
-							}
-							ret = send_recv_cmd(data, 0x03, 0x8B, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000L);
-							break;
-						default:
-							return -EOPNOTSUPP;
-					}
-					break;
-				case hwmon_in_min: //todo: switch to rated_min for kernel 5.10
-					switch (channel) {
-						case 1:
-							ret = send_recv_cmd(data, 0x02, 0x00, 0x00, NULL, 0);
-							if (ret < 0) {
-								goto err;
-							}
-							ret = send_recv_cmd(data, 0x03, 0x44, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000L);
-							break;
-						case 2:
-							ret = send_recv_cmd(data, 0x02, 0x00, 0x01, NULL, 0);
-							if (ret < 0) {
-								goto err;
-							}
-							ret = send_recv_cmd(data, 0x03, 0x44, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000L);
-							break;
-						case 3:
-							ret = send_recv_cmd(data, 0x02, 0x00, 0x02, NULL, 0);
-							if (ret < 0) {
-								goto err;
-							}
-							ret = send_recv_cmd(data, 0x03, 0x44, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000L);
-							break;
-						default:
-							return -EOPNOTSUPP;
-					}
-					break;
-				case hwmon_in_max: //todo: switch to rated_max for kernel 5.10
-					switch (channel) {
-						case 1:
-							ret = send_recv_cmd(data, 0x02, 0x00, 0x00, NULL, 0);
-							if (ret < 0) {
-								goto err;
-							}
-							ret = send_recv_cmd(data, 0x03, 0x40, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000L);
-							break;
-						case 2:
-							ret = send_recv_cmd(data, 0x02, 0x00, 0x01, NULL, 0);
-							if (ret < 0) {
-								goto err;
-							}
-							ret = send_recv_cmd(data, 0x03, 0x40, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000L);
-							break;
-						case 3:
-							ret = send_recv_cmd(data, 0x02, 0x00, 0x02, NULL, 0);
-							if (ret < 0) {
-								goto err;
-							}
-							ret = send_recv_cmd(data, 0x03, 0x40, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000L);
-							break;
-						default:
-							return -EOPNOTSUPP;
-					}
-					break;
-				default:
-					return -EOPNOTSUPP;
-			}
-			break;
+#define CORSAIRPSU_CHIP_REG(t, a, ch, op, sc, cl) { \
+	.type = hwmon_##t, .attr = hwmon_##t##_##a, .channel = (ch), \
+	.page = CORSAIRPSU_PAGE_UNKNOWN, .opcode = (op), \
+	.format = CORSAIRPSU_LINEAR11, .scale = (sc), .class = CORSAIRPSU_##cl }
+#define CORSAIRPSU_RAIL_REG(t, a, ch, rail, op, fmt, sc, cl) { \
+	.type = hwmon_##t, .attr = hwmon_##t##_##a, .channel = (ch), \
+	.page = (rail), .opcode = (op), \
+	.format = CORSAIRPSU_##fmt, .scale = (sc), .class = CORSAIRPSU_##cl }
+#define CORSAIRPSU_CUSTOM_REG(op, cl) { \
+	.type = hwmon_max, .channel = -1, \
+	.page = CORSAIRPSU_PAGE_UNKNOWN, .opcode = (op), \
+	.format = CORSAIRPSU_U32, .class = CORSAIRPSU_##cl }
+#define CORSAIRPSU_PWM_REG(op) { \
+	.type = hwmon_pwm, .attr = hwmon_pwm_input, .channel = 0, \
+	.page = CORSAIRPSU_PAGE_UNKNOWN, .opcode = (op), \
+	.format = CORSAIRPSU_U8, .class = CORSAIRPSU_SLOW }
+#define CORSAIRPSU_STATUS_REG(rail, op, fmt) { \
+	.type = hwmon_max, .channel = -1, \
+	.page = (rail), .opcode = (op), \
+	.format = CORSAIRPSU_##fmt, .class = CORSAIRPSU_FAST }
+
+// a voltage, current and power register on each of the rails
+#define CORSAIRPSU_RAIL_REGS(id, t, a, ch, op, fmt, sc, cl) \
+	[id + 0] = CORSAIRPSU_RAIL_REG(t, a, (ch) + 0, 0, op, fmt, sc, cl), \
+	[id + 1] = CORSAIRPSU_RAIL_REG(t, a, (ch) + 1, 1, op, fmt, sc, cl), \
+	[id + 2] = CORSAIRPSU_RAIL_REG(t, a, (ch) + 2, 2, op, fmt, sc, cl)
+
+static const struct corsairpsu_reg corsairpsu_regs[CORSAIRPSU_NUM_REGS] = {
+	[CORSAIRPSU_REG_TEMP1]		= CORSAIRPSU_CHIP_REG(temp, input, 0, 0x8D, 1000, SLOW),
+	[CORSAIRPSU_REG_TEMP2]		= CORSAIRPSU_CHIP_REG(temp, input, 1, 0x8E, 1000, SLOW),
+	//TODO: for kernel 5.10, use hwmon_temp_rated_max
+	[CORSAIRPSU_REG_TEMP_MAX]	= CORSAIRPSU_CHIP_REG(temp, max, -1, 0x4F, 1000, STATIC),
+	[CORSAIRPSU_REG_FAN]		= CORSAIRPSU_CHIP_REG(fan, input, 0, 0x90, 1, SLOW),
+	[CORSAIRPSU_REG_IN_SUPPLY]	= CORSAIRPSU_CHIP_REG(in, input, 0, 0x88, 1000, FAST),
+	[CORSAIRPSU_REG_POWER_TOTAL]	= CORSAIRPSU_CHIP_REG(power, input, 0, 0xEE, 1000000, FAST),
+	[CORSAIRPSU_REG_CURR_SUPPLY]	= CORSAIRPSU_CHIP_REG(curr, input, 3, 0x89, 1000, FAST),
+	[CORSAIRPSU_REG_TOTAL_UPTIME]	= CORSAIRPSU_CUSTOM_REG(0xD1, SLOW),
+	[CORSAIRPSU_REG_CURRENT_UPTIME]	= CORSAIRPSU_CUSTOM_REG(0xD2, SLOW),
+	[CORSAIRPSU_REG_OCP_MODE]	= CORSAIRPSU_CUSTOM_REG(0xD8, SLOW),
+	[CORSAIRPSU_REG_FAN_CONTROL]	= CORSAIRPSU_CUSTOM_REG(0xF0, SLOW),
+	[CORSAIRPSU_REG_FAN_PWM]	= CORSAIRPSU_PWM_REG(0x3B),
+	CORSAIRPSU_RAIL_REGS(CORSAIRPSU_REG_IN_RAIL, in, input, 1, 0x8B, VOUT, 1000, FAST),
+	//todo: switch to rated_max/rated_min for kernel 5.10
+	CORSAIRPSU_RAIL_REGS(CORSAIRPSU_REG_IN_MAX, in, max, 1, 0x40, LINEAR11, 1000, STATIC),
+	CORSAIRPSU_RAIL_REGS(CORSAIRPSU_REG_IN_MIN, in, min, 1, 0x44, LINEAR11, 1000, STATIC),
+	CORSAIRPSU_RAIL_REGS(CORSAIRPSU_REG_CURR, curr, input, 0, 0x8C, LINEAR11, 1000, FAST),
+	CORSAIRPSU_RAIL_REGS(CORSAIRPSU_REG_CURR_MAX, curr, max, 0, 0x46, LINEAR11, 1000, STATIC),
+	CORSAIRPSU_RAIL_REGS(CORSAIRPSU_REG_POWER_RAIL, power, input, 1, 0x96, LINEAR11, 1000000, FAST),
+	// PMBus status registers, backing the alarms
+	[CORSAIRPSU_REG_STATUS_TEMP]	= CORSAIRPSU_STATUS_REG(CORSAIRPSU_PAGE_UNKNOWN, 0x7D, U8),
+	[CORSAIRPSU_REG_STATUS_CML]	= CORSAIRPSU_STATUS_REG(CORSAIRPSU_PAGE_UNKNOWN, 0x7E, U8),
+	[CORSAIRPSU_REG_STATUS_FANS]	= CORSAIRPSU_STATUS_REG(CORSAIRPSU_PAGE_UNKNOWN, 0x81, U8),
+	[CORSAIRPSU_REG_STATUS_WORD + 0] = CORSAIRPSU_STATUS_REG(0, 0x79, U16),
+	[CORSAIRPSU_REG_STATUS_WORD + 1] = CORSAIRPSU_STATUS_REG(1, 0x79, U16),
+	[CORSAIRPSU_REG_STATUS_WORD + 2] = CORSAIRPSU_STATUS_REG(2, 0x79, U16),
+};
 
-		// Current (microamp)
-		case hwmon_curr:
-			switch (attr) {
-				case hwmon_curr_input:
-					switch (channel) {
-						case 0: // current 12v
-							ret = send_recv_cmd(data, 0x02, 0x00, 0x00, NULL, 0);
-							if (ret < 0) {
-								goto err;
-							}
-							ret = send_recv_cmd(data, 0x03, 0x8C, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000L);
-							break;
-						case 1: // current 5v
-							ret = send_recv_cmd(data, 0x02, 0x00, 0x01, NULL, 0);
-							if (ret < 0) {
-								goto err;
-							}
-							ret = send_recv_cmd(data, 0x03, 0x8C, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000L);
-							break;
-						case 2: // current 3.3v
-							ret = send_recv_cmd(data, 0x02, 0x00, 0x02, NULL, 0);
-							if (ret < 0) {
-								goto err;
-							}
-							ret = send_recv_cmd(data, 0x03, 0x8C, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000L);
-							break;
-						default:
-							return -EOPNOTSUPP;
-					}
-					break;
-				case hwmon_curr_max: //todo: switch to rated_max for kernel 5.10
-					switch (channel) {
-						case 0:
-							ret = send_recv_cmd(data, 0x02, 0x00, 0x00, NULL, 0);
-							if (ret < 0) {
-								goto err;
-							}
-							ret = send_recv_cmd(data, 0x03, 0x46, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000L);
-							break;
-						case 1:
-							ret = send_recv_cmd(data, 0x02, 0x00, 0x01, NULL, 0);
-							if (ret < 0) {
-								goto err;
-							}
-							ret = send_recv_cmd(data, 0x03, 0x46, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000L);
-							break;
-						case 2:
-							ret = send_recv_cmd(data, 0x02, 0x00, 0x02, NULL, 0);
-							if (ret < 0) {
-								goto err;
-							}
-							ret = send_recv_cmd(data, 0x03, 0x46, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000L);
-							break;
-						default:
-							return -EOPNOTSUPP;
-					}
-					break;
-				default:
-					return -EOPNOTSUPP;
-			}
-			break;
+/*
+	Alarm map, a status register bit per hwmon alarm attribute
 
-		// Power (microwatt)
-		case hwmon_power:
-			switch (attr) {
-				case hwmon_power_input:
-					switch (channel) {
-						case 0: // power total
-							ret = send_recv_cmd(data, 0x03, 0xEE, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000000L);
-							break;
-						case 1: // power 12v
-							ret = send_recv_cmd(data, 0x02, 0x00, 0x00, NULL, 0);
-							if (ret < 0) {
-								goto err;
-							}
-							ret = send_recv_cmd(data, 0x03, 0x96, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000000L);
-							break;
-						case 2: // power 5v
-							ret = send_recv_cmd(data, 0x02, 0x00, 0x01, NULL, 0);
-							if (ret < 0) {
-								goto err;
-							}
-							ret = send_recv_cmd(data, 0x03, 0x96, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000000L);
-							break;
-						case 3: // power 3.3v
-							ret = send_recv_cmd(data, 0x02, 0x00, 0x02, NULL, 0);
-							if (ret < 0) {
-								goto err;
-							}
-							ret = send_recv_cmd(data, 0x03, 0x96, 0x00, &reading, sizeof(u16));
-							if (ret < 0) {
-								goto err;
-							}
-							*val = pmbus_linear11_to_long(reading, 1000000L);
-							break;
-						default:
-							return -EOPNOTSUPP;
-					}
-					break;
-				default:
-					return -EOPNOTSUPP;
-			}
-			break;
+	STATUS_WORD (0x79)          15 vout, 14 iout/pout, 13 input, 5 vout OV fault,
+	                            4 iout OC fault, 3 vin UV fault
+	STATUS_TEMPERATURE (0x7D)   7 OT fault, 6 OT warning
+	STATUS_CML (0x7E)           any bit, communication/memory/logic fault
+	STATUS_FANS_1_2 (0x81)      7 fan 1 fault, 5 fan 1 warning
+*/
+struct corsairpsu_alarm {
+	enum hwmon_sensor_types type;
+	u32 attr;
+	int channel;
+	enum corsairpsu_reg_id reg;
+	u16 mask;
+};
+
+#define CORSAIRPSU_ALARM(t, a, ch, r, m) { \
+	.type = hwmon_##t, .attr = hwmon_##t##_##a, .channel = (ch), \
+	.reg = (r), .mask = (m) }
+
+static const struct corsairpsu_alarm corsairpsu_alarms[] = {
+	CORSAIRPSU_ALARM(temp, alarm, 0, CORSAIRPSU_REG_STATUS_TEMP, BIT(6)),
+	CORSAIRPSU_ALARM(temp, crit_alarm, 0, CORSAIRPSU_REG_STATUS_TEMP, BIT(7)),
+	CORSAIRPSU_ALARM(temp, alarm, 1, CORSAIRPSU_REG_STATUS_TEMP, BIT(6)),
+	CORSAIRPSU_ALARM(temp, crit_alarm, 1, CORSAIRPSU_REG_STATUS_TEMP, BIT(7)),
+	CORSAIRPSU_ALARM(fan, alarm, 0, CORSAIRPSU_REG_STATUS_FANS, BIT(5)),
+	CORSAIRPSU_ALARM(fan, fault, 0, CORSAIRPSU_REG_STATUS_FANS, BIT(7)),
+	// input status is the same on every page, use the 12v one
+	CORSAIRPSU_ALARM(in, alarm, 0, CORSAIRPSU_REG_STATUS_WORD, BIT(13)),
+	CORSAIRPSU_ALARM(in, lcrit_alarm, 0, CORSAIRPSU_REG_STATUS_WORD, BIT(3)),
+	CORSAIRPSU_ALARM(in, alarm, 1, CORSAIRPSU_REG_STATUS_WORD + 0, BIT(15)),
+	CORSAIRPSU_ALARM(in, crit_alarm, 1, CORSAIRPSU_REG_STATUS_WORD + 0, BIT(5)),
+	CORSAIRPSU_ALARM(in, alarm, 2, CORSAIRPSU_REG_STATUS_WORD + 1, BIT(15)),
+	CORSAIRPSU_ALARM(in, crit_alarm, 2, CORSAIRPSU_REG_STATUS_WORD + 1, BIT(5)),
+	CORSAIRPSU_ALARM(in, alarm, 3, CORSAIRPSU_REG_STATUS_WORD + 2, BIT(15)),
+	CORSAIRPSU_ALARM(in, crit_alarm, 3, CORSAIRPSU_REG_STATUS_WORD + 2, BIT(5)),
+	CORSAIRPSU_ALARM(curr, alarm, 0, CORSAIRPSU_REG_STATUS_WORD + 0, BIT(14)),
+	CORSAIRPSU_ALARM(curr, crit_alarm, 0, CORSAIRPSU_REG_STATUS_WORD + 0, BIT(4)),
+	CORSAIRPSU_ALARM(curr, alarm, 1, CORSAIRPSU_REG_STATUS_WORD + 1, BIT(14)),
+	CORSAIRPSU_ALARM(curr, crit_alarm, 1, CORSAIRPSU_REG_STATUS_WORD + 1, BIT(4)),
+	CORSAIRPSU_ALARM(curr, alarm, 2, CORSAIRPSU_REG_STATUS_WORD + 2, BIT(14)),
+	CORSAIRPSU_ALARM(curr, crit_alarm, 2, CORSAIRPSU_REG_STATUS_WORD + 2, BIT(4)),
+	// custom comms_alarm attribute
+	{ .type = hwmon_max, .channel = -1, .reg = CORSAIRPSU_REG_STATUS_CML, .mask = 0xff },
+};
+
+#define CORSAIRPSU_NUM_ALARMS	ARRAY_SIZE(corsairpsu_alarms)
 
+static size_t corsairpsu_format_size(enum corsairpsu_format format) {
+	switch (format) {
+		case CORSAIRPSU_U32:
+			return 4;
+		case CORSAIRPSU_U8:
+			return 1;
 		default:
-			return -EOPNOTSUPP;
+			return 2;
 	}
+}
 
-	return 0;
-
-err:
-	if (ret == USB_MUTEX_LOCKED_ERR) {
-		return -EINVAL;
+// a register value in hwmon units, one decoder per format
+static long corsairpsu_decode(const struct corsairpsu_data* data,
+			      const struct corsairpsu_reg *reg, const u8 *raw) {
+	switch (reg->format) {
+		case CORSAIRPSU_U32:
+			return pmbus_u32_to_long(raw);
+		case CORSAIRPSU_U16:
+			return get_unaligned_le16(raw);
+		case CORSAIRPSU_U8:
+			return raw[0];
+		case CORSAIRPSU_VOUT:
+			if (data->vout_linear16[reg->page]) {
+				return pmbus_linear16_to_long(get_unaligned_le16(raw),
+							      data->vout_exponent[reg->page], reg->scale);
+			}
+			fallthrough;
+		case CORSAIRPSU_LINEAR11:
+		default:
+			return pmbus_linear11_to_long(get_unaligned_le16(raw), reg->scale);
 	}
-	return -EOPNOTSUPP;
 }
 
-static const char *corsairpsu_chip_label[] = {
-	"total uptime",
-	"uptime",
-};
+// nominal output voltage of the rails, in mV
+static const long corsairpsu_rail_nominal[CORSAIRPSU_RAILS] = { 12000, 5000, 3300 };
 
-static const char *corsairpsu_temp_label[] = {
-	"temp1",
-	"temp2",
+/*
+	Read VOUT_MODE on every rail, with update_lock held
+
+	A rail whose mode can't be read or isn't linear keeps decoding its output
+	voltage as LINEAR11, like the PSUs that don't implement VOUT_MODE. So does
+	a rail whose READ_VOUT, decoded as LINEAR16, is more than 25% off its
+	nominal voltage: the firmware may report a linear mode and still answer
+	LINEAR11 words, as the Corsair units are known to.
+*/
+static void corsairpsu_read_vout_modes(struct corsairpsu_data* data) {
+	struct corsairpsu_cmd cmds[2];
+	u8 mode, vout[2];
+	long mv, nominal;
+	int rail, ret;
+
+	for (rail = 0; rail < CORSAIRPSU_RAILS; rail++) {
+		cmds[0] = (struct corsairpsu_cmd) {
+			.addr = 0x03,
+			.opcode = PMBUS_VOUT_MODE,
+			.dst = &mode,
+			.len = sizeof(mode),
+		};
+		cmds[1] = (struct corsairpsu_cmd) {
+			.addr = 0x03,
+			.opcode = corsairpsu_regs[CORSAIRPSU_REG_IN_RAIL + rail].opcode,
+			.dst = vout,
+			.len = sizeof(vout),
+		};
+		data->vout_linear16[rail] = false;
+		ret = send_recv_batch(data, rail, cmds, ARRAY_SIZE(cmds));
+		if (ret < 0 || (mode & PMBUS_VOUT_MODE_MASK) != PMBUS_VOUT_MODE_LINEAR) {
+			continue;
+		}
+
+		// sign extend the 5 bit exponent
+		data->vout_exponent[rail] = ((s8)(mode << 3)) >> 3;
+		mv = pmbus_linear16_to_long(get_unaligned_le16(vout), data->vout_exponent[rail], 1000);
+		nominal = corsairpsu_rail_nominal[rail];
+		if (abs(mv - nominal) > nominal / 4) {
+			hid_info(data->hdev, "rail %d: VOUT_MODE is linear but READ_VOUT isn't LINEAR16 (%ld mV), decoding it as LINEAR11\n",
+				 rail, mv);
+			continue;
+		}
+		data->vout_linear16[rail] = true;
+	}
+}
+
+// the register behind a hwmon attribute, or -1
+static int corsairpsu_find_reg(enum hwmon_sensor_types type, u32 attr, int channel) {
+	int i;
+
+	for (i = 0; i < CORSAIRPSU_NUM_REGS; i++) {
+		const struct corsairpsu_reg *reg = &corsairpsu_regs[i];
+
+		if (reg->type == type && reg->attr == attr &&
+		    (reg->channel == -1 || reg->channel == channel)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+// the alarm behind a hwmon attribute, or -1
+static int corsairpsu_find_alarm(enum hwmon_sensor_types type, u32 attr, int channel) {
+	int i;
+
+	for (i = 0; i < CORSAIRPSU_NUM_ALARMS; i++) {
+		const struct corsairpsu_alarm *alarm = &corsairpsu_alarms[i];
+
+		if (alarm->type == type && alarm->attr == attr && alarm->channel == channel) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static bool corsairpsu_alarm_raised(const struct corsairpsu_alarm *alarm,
+				    const struct corsairpsu_snapshot *s) {
+	return s->values[alarm->reg] & alarm->mask;
+}
+
+/*
+	Tell pollers of the alarm attributes that changed between two snapshots,
+	once the new one is published
+*/
+static void corsairpsu_notify_alarms(struct corsairpsu_data* data,
+				     const struct corsairpsu_snapshot *old,
+				     const struct corsairpsu_snapshot *new) {
+	int i;
+
+	if (IS_ERR_OR_NULL(data->hwmon_dev)) {
+		return;
+	}
+
+	for (i = 0; i < CORSAIRPSU_NUM_ALARMS; i++) {
+		const struct corsairpsu_alarm *alarm = &corsairpsu_alarms[i];
+
+		if (corsairpsu_alarm_raised(alarm, old) == corsairpsu_alarm_raised(alarm, new)) {
+			continue;
+		}
+		if (alarm->type == hwmon_max) {
+			sysfs_notify(&data->hwmon_dev->kobj, NULL, "comms_alarm");
+		} else {
+			hwmon_notify_event(data->hwmon_dev, alarm->type, alarm->attr, alarm->channel);
+		}
+	}
+}
+
+/*
+	Read the registers of corsairpsu_regs[] in the classes mask into a snapshot,
+	the caller's snapshot is only updated if 0 is returned.
+
+	Registers are read in one pipelined batch for the whole PSU, then one per rail.
+*/
+static bool corsairpsu_reg_swept(const struct corsairpsu_data* data, int i,
+				 unsigned int classes) {
+	return (classes & BIT(corsairpsu_regs[i].class)) && test_bit(i, data->supported);
+}
+
+/*
+	Fill data->sweep_cmds with the supported registers of a page in the classes
+	mask, their ids in ids if not NULL. Returns the number of commands.
+*/
+static unsigned int corsairpsu_build_batch(struct corsairpsu_data* data, int page,
+					   unsigned int classes, int *ids) {
+	unsigned int count = 0;
+	int i;
+
+	for (i = 0; i < CORSAIRPSU_NUM_REGS; i++) {
+		const struct corsairpsu_reg *reg = &corsairpsu_regs[i];
+
+		if (reg->page != page || !corsairpsu_reg_swept(data, i, classes)) {
+			continue;
+		}
+		data->sweep_cmds[count] = (struct corsairpsu_cmd) {
+			.addr = 0x03,
+			.opcode = reg->opcode,
+			.dst = data->sweep_raw[i],
+			.len = corsairpsu_format_size(reg->format),
+		};
+		if (ids) {
+			ids[count] = i;
+		}
+		count++;
+	}
+
+	return count;
+}
+
+static int corsairpsu_sweep(struct corsairpsu_data* data, struct corsairpsu_snapshot *s,
+							unsigned int classes) {
+	int page, ret, i;
+	unsigned int count;
+
+	for (page = CORSAIRPSU_PAGE_UNKNOWN; page < CORSAIRPSU_RAILS; page++) {
+		count = corsairpsu_build_batch(data, page, classes, NULL);
+		if (count == 0) {
+			continue;
+		}
+
+		ret = send_recv_batch(data, page, data->sweep_cmds, count);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	for (i = 0; i < CORSAIRPSU_NUM_REGS; i++) {
+		if (corsairpsu_reg_swept(data, i, classes)) {
+			s->values[i] = corsairpsu_decode(data, &corsairpsu_regs[i], data->sweep_raw[i]);
+		}
+	}
+
+	return 0;
+}
+
+/*
+	Find out which registers of corsairpsu_regs[] the PSU answers, at probe
+
+	Models differ (HX vs RM, fan control, ...). A register answered with
+	another opcode, even after a handshake, is left out of the sweeps and its
+	attributes are hidden. If a page can't be read at all its registers are
+	kept, the sweeps will report the errors.
+*/
+static void corsairpsu_discover(struct corsairpsu_data* data) {
+	int ids[CORSAIRPSU_NUM_REGS];
+	int page, ret, i;
+	unsigned int count;
+
+	bitmap_fill(data->supported, CORSAIRPSU_NUM_REGS);
+
+	for (page = CORSAIRPSU_PAGE_UNKNOWN; page < CORSAIRPSU_RAILS; page++) {
+		count = corsairpsu_build_batch(data, page, CORSAIRPSU_ALL_CLASSES, ids);
+		if (count == 0) {
+			continue;
+		}
+
+		ret = send_recv_batch(data, page, data->sweep_cmds, count);
+		if (ret < 0 && ret != -ENODATA) {
+			hid_warn(data->hdev, "can't discover the registers of page %d (%d)\n", page, ret);
+			continue;
+		}
+		for (i = 0; i < count; i++) {
+			if (data->sweep_cmds[i].status < 0) {
+				hid_dbg(data->hdev, "register 0x%02x of page %d not supported\n",
+					corsairpsu_regs[ids[i]].opcode, page);
+				clear_bit(ids[i], data->supported);
+			}
+		}
+	}
+}
+
+/*
+	Take the update lock, queueing behind the sweep in progress if any
+
+	The wait can be interrupted and is bounded by CORSAIRPSU_LOCK_TIMEOUT so a
+	wedged PSU doesn't pile up readers forever.
+*/
+static int corsairpsu_lock(struct corsairpsu_data* data) {
+	ktime_t start = ktime_get(), wait;
+	long ret;
+
+	ret = wait_event_interruptible_timeout(data->update_wait,
+					       mutex_trylock(&data->update_lock),
+					       msecs_to_jiffies(CORSAIRPSU_LOCK_TIMEOUT));
+
+	wait = ktime_sub(ktime_get(), start);
+	atomic_long_inc(&data->stats->lock_waits);
+	atomic64_add(ktime_to_ns(wait), &data->stats->lock_wait_ns);
+	corsairpsu_hist_add(&data->stats->lock_wait, wait);
+
+	if (ret == 0) {
+		return -EBUSY;
+	}
+	if (ret < 0) {
+		return ret;
+	}
+
+	return 0;
+}
+
+static void corsairpsu_unlock(struct corsairpsu_data* data) {
+	mutex_unlock(&data->update_lock);
+	wake_up(&data->update_wait);
+}
+
+// the register of a power channel, total then the rails
+static enum corsairpsu_reg_id corsairpsu_power_reg(int channel) {
+	return channel == 0 ? CORSAIRPSU_REG_POWER_TOTAL : CORSAIRPSU_REG_POWER_RAIL + channel - 1;
+}
+
+static void corsairpsu_reset_power_stats(struct corsairpsu_snapshot *s, int channel) {
+	struct corsairpsu_power_stats *stats = &s->power[channel];
+
+	stats->highest = s->values[corsairpsu_power_reg(channel)];
+	stats->lowest = stats->highest;
+	stats->reset_energy = stats->energy;
+	stats->reset_timestamp = s->timestamp;
+}
+
+/*
+	Integrate the power readings of a new snapshot since the previous one
+
+	Trapezoid rule, so the energy stays accurate even at a low sampling rate
+	as long as the power varies smoothly.
+*/
+static void corsairpsu_account_power(const struct corsairpsu_snapshot *old,
+				     struct corsairpsu_snapshot *new) {
+	u64 dt = max_t(s64, new->timestamp - old->timestamp, 0) / NSEC_PER_USEC;
+	int i;
+
+	for (i = 0; i < CORSAIRPSU_POWERS; i++) {
+		struct corsairpsu_power_stats *stats = &new->power[i];
+		enum corsairpsu_reg_id reg = corsairpsu_power_reg(i);
+		long power = new->values[reg];
+		u64 energy;
+
+		// uW * us = pJ, kept in nJ until it amounts to a uJ, without overflowing
+		// the pJ of the long gaps between on demand sweeps
+		energy = mul_u64_u64_div_u64(((u64)max(old->values[reg], 0L) + max(power, 0L)) / 2,
+					     dt, 1000);
+		energy += stats->energy_rem;
+		stats->energy += div_u64(energy, 1000);
+		stats->energy_rem = energy - div_u64(energy, 1000) * 1000;
+
+		stats->highest = max(stats->highest, power);
+		stats->lowest = min(stats->lowest, power);
+	}
+}
+
+// drop the samples of a channel window older than its interval
+static void corsairpsu_window_expire(struct corsairpsu_data* data, int channel, s64 now) {
+	struct corsairpsu_window *w = &data->windows[channel];
+	s64 start = now - (s64)w->interval * NSEC_PER_MSEC;
+
+	while (w->count > 0 && data->window[w->tail].timestamp < start) {
+		w->sum -= data->window[w->tail].power[channel];
+		w->tail = (w->tail + 1) % CORSAIRPSU_WINDOW;
+		w->count--;
+	}
+}
+
+/*
+	Add the power readings of a new snapshot to the averaging windows
+
+	Each window keeps a running sum, so it costs the same whatever its length.
+	When the samples are all in use the oldest one is dropped, the window is
+	then shorter than its interval.
+*/
+static void corsairpsu_window_push(struct corsairpsu_data* data,
+				   const struct corsairpsu_snapshot *s) {
+	struct corsairpsu_window_sample *sample = &data->window[data->window_head];
+	struct corsairpsu_window *w;
+	int i;
+
+	for (i = 0; i < CORSAIRPSU_POWERS; i++) {
+		w = &data->windows[i];
+		if (w->count == CORSAIRPSU_WINDOW) {
+			w->sum -= sample->power[i];
+			w->tail = (w->tail + 1) % CORSAIRPSU_WINDOW;
+			w->count--;
+		}
+	}
+
+	sample->timestamp = s->timestamp;
+	for (i = 0; i < CORSAIRPSU_POWERS; i++) {
+		w = &data->windows[i];
+		sample->power[i] = s->values[corsairpsu_power_reg(i)];
+		w->sum += sample->power[i];
+		w->count++;
+		corsairpsu_window_expire(data, i, s->timestamp);
+	}
+
+	data->window_head = (data->window_head + 1) % CORSAIRPSU_WINDOW;
+}
+
+/*
+	Average power of a channel in uW, over its window or since the last
+	reset_history without an interval
+*/
+static long corsairpsu_power_average(const struct corsairpsu_data* data,
+				     const struct corsairpsu_snapshot *s, int channel) {
+	const struct corsairpsu_power_stats *stats = &s->power[channel];
+	const struct corsairpsu_window *w = &data->windows[channel];
+	u64 dt;
+
+	if (w->interval) {
+		if (w->count == 0) {
+			return s->values[corsairpsu_power_reg(channel)];
+		}
+		return div64_s64(w->sum, w->count);
+	}
+
+	dt = div_u64(s->timestamp - stats->reset_timestamp, NSEC_PER_MSEC);
+	if (dt == 0) {
+		return s->values[corsairpsu_power_reg(channel)];
+	}
+
+	return div64_u64((stats->energy - stats->reset_energy) * 1000, dt);
+}
+
+// the AC side power can be derived
+static bool corsairpsu_has_power_in(const struct corsairpsu_data* data) {
+	return test_bit(CORSAIRPSU_REG_IN_SUPPLY, data->supported) &&
+	       test_bit(CORSAIRPSU_REG_CURR_SUPPLY, data->supported);
+}
+
+/*
+	AC side power and efficiency, from the input voltage and current, so only
+	on the PSUs answering READ_IIN: their own total is computed from the rails
+	and would always give about 100%. The output is the sum of the rails.
+*/
+static void corsairpsu_derive(const struct corsairpsu_data* data, struct corsairpsu_snapshot *s) {
+	const long *v = s->values;
+	s64 power_in = 0, power_out = 0;
+	int i;
+
+	// millivolts times milliamps are microwatts
+	if (corsairpsu_has_power_in(data)) {
+		power_in = (s64)v[CORSAIRPSU_REG_IN_SUPPLY] * v[CORSAIRPSU_REG_CURR_SUPPLY];
+	}
+	s->power_in = clamp_val(power_in, 0, LONG_MAX);
+
+	for (i = 0; i < CORSAIRPSU_RAILS; i++) {
+		power_out += v[CORSAIRPSU_REG_POWER_RAIL + i];
+	}
+	s->efficiency = power_in > 0 ? div64_s64(power_out * 1000, power_in) : -1;
+}
+
+/*
+	Sweep some register classes of the PSU into the snapshot, with update_lock held
+
+	The other classes keep their last values. The snapshot is only valid once
+	every class was read, and is refreshed whenever the fast class is.
+*/
+static int corsairpsu_refresh_classes(struct corsairpsu_data* data, unsigned int classes) {
+	struct corsairpsu_snapshot old = data->snapshot;
+	struct corsairpsu_snapshot snapshot = old;
+	ktime_t start, duration;
+	int ret, class, i;
+
+	start = ktime_get();
+	ret = corsairpsu_sweep(data, &snapshot, classes);
+	duration = ktime_sub(ktime_get(), start);
+	corsairpsu_hist_add(&data->stats->sweep, duration);
+	trace_corsairpsu_sweep(data->hdev, classes, ktime_to_ns(duration), ret);
+	if (ret < 0) {
+		if (classes & BIT(CORSAIRPSU_FAST)) {
+			data->valid = false;
+		}
+		return ret;
+	}
+
+	snapshot.timestamp = ktime_get_ns();
+	if (classes & BIT(CORSAIRPSU_FAST)) {
+		corsairpsu_derive(data, &snapshot);
+		if (data->classes_loaded & BIT(CORSAIRPSU_FAST)) {
+			corsairpsu_account_power(&old, &snapshot);
+		} else {
+			for (i = 0; i < CORSAIRPSU_POWERS; i++) {
+				corsairpsu_reset_power_stats(&snapshot, i);
+			}
+		}
+	}
+
+	write_seqcount_begin(&data->snapshot_seq);
+	data->snapshot = snapshot;
+	if (classes & BIT(CORSAIRPSU_FAST)) {
+		corsairpsu_window_push(data, &snapshot);
+	}
+	write_seqcount_end(&data->snapshot_seq);
+
+	for (class = 0; class < CORSAIRPSU_NUM_CLASSES; class++) {
+		if (classes & BIT(class)) {
+			data->class_updated[class] = jiffies;
+		}
+	}
+	WRITE_ONCE(data->classes_loaded, data->classes_loaded | classes);
+
+	if (classes & BIT(CORSAIRPSU_FAST)) {
+		data->last_updated = jiffies;
+		data->generation++;
+		data->valid = data->classes_loaded == CORSAIRPSU_ALL_CLASSES;
+	}
+
+	corsairpsu_notify_alarms(data, &old, &snapshot);
+
+	return 0;
+}
+
+/*
+	Sweep the PSU into the snapshot, with update_lock held
+
+	Static registers are only read until they succeed once, slow ones only when
+	older than slow_interval.
+*/
+static int corsairpsu_refresh(struct corsairpsu_data* data) {
+	unsigned int classes = BIT(CORSAIRPSU_FAST);
+
+	if (!(data->classes_loaded & BIT(CORSAIRPSU_SLOW)) ||
+	    time_after(jiffies, data->class_updated[CORSAIRPSU_SLOW] + msecs_to_jiffies(slow_interval))) {
+		classes |= BIT(CORSAIRPSU_SLOW);
+	}
+	if (!(data->classes_loaded & BIT(CORSAIRPSU_STATIC))) {
+		classes |= BIT(CORSAIRPSU_STATIC);
+	}
+
+	return corsairpsu_refresh_classes(data, classes);
+}
+
+/*
+	Get an up to date snapshot of all the sensors
+
+	The PSU is only queried when the cached snapshot is older than cache_timeout,
+	so reading all the attributes at once (e.g. 'sensors') costs a single sweep.
+	Readers arriving during a sweep wait for it and share its result.
+	When the background sampler runs, the latest snapshot is served as is.
+	Until the PSU is identified there is no snapshot, -EAGAIN.
+*/
+static struct corsairpsu_snapshot *corsairpsu_update_device(struct device *dev) {
+	struct corsairpsu_data *data = dev_get_drvdata(dev);
+	unsigned long generation = READ_ONCE(data->generation);
+	int ret = 0;
+
+	if (!smp_load_acquire(&data->ready)) {
+		return ERR_PTR(-EAGAIN);
+	}
+
+	// the sampler keeps the snapshot fresh, don't touch the PSU
+	if (READ_ONCE(data->update_interval) != 0 && READ_ONCE(data->valid)) {
+		atomic_long_inc(&data->stats->cache_hits);
+		return &data->snapshot;
+	}
+
+	ret = corsairpsu_lock(data);
+	if (ret < 0) {
+		return ERR_PTR(ret);
+	}
+
+	// a sweep completed while we were waiting for it, share its result
+	if (data->valid && data->generation != generation) {
+		atomic_long_inc(&data->stats->cache_coalesced);
+		goto unlock;
+	}
+
+	if (!data->valid || cache_timeout == 0 ||
+	    time_after(jiffies, data->last_updated + msecs_to_jiffies(cache_timeout))) {
+		atomic_long_inc(&data->stats->cache_misses);
+		ret = corsairpsu_refresh(data);
+	} else {
+		atomic_long_inc(&data->stats->cache_hits);
+	}
+
+unlock:
+	corsairpsu_unlock(data);
+
+	if (ret < 0) {
+		return ERR_PTR(-EOPNOTSUPP);
+	}
+
+	return &data->snapshot;
+}
+
+static __s32 sample_value(long val) {
+	return clamp_val(val, S32_MIN, S32_MAX);
+}
+
+// the register behind each bit of the valid bitmap of a sample
+static const enum corsairpsu_reg_id corsairpsu_sample_regs[] = {
+	CORSAIRPSU_REG_IN_SUPPLY,
+	CORSAIRPSU_REG_IN_RAIL, CORSAIRPSU_REG_IN_RAIL + 1, CORSAIRPSU_REG_IN_RAIL + 2,
+	CORSAIRPSU_REG_CURR, CORSAIRPSU_REG_CURR + 1, CORSAIRPSU_REG_CURR + 2,
+	CORSAIRPSU_REG_POWER_TOTAL,
+	CORSAIRPSU_REG_POWER_RAIL, CORSAIRPSU_REG_POWER_RAIL + 1, CORSAIRPSU_REG_POWER_RAIL + 2,
+	CORSAIRPSU_REG_TEMP1,
+	CORSAIRPSU_REG_TEMP2,
+	CORSAIRPSU_REG_FAN,
+	CORSAIRPSU_REG_CURR_SUPPLY,
+};
+
+/*
+	Record a sweep of the sampler into the ring, or a gap if it failed
+
+	The sampler is the only producer, so this doesn't need to lock the ring.
+*/
+static void corsairpsu_push_sample(struct corsairpsu_data* data,
+				   const struct corsairpsu_snapshot *s) {
+	struct corsairpsu_sample sample = { 0 };
+	int i;
+
+	// no samples file
+	if (!kfifo_initialized(&data->ring)) {
+		return;
+	}
+
+	sample.timestamp = ktime_get_ns();
+	if (s != NULL) {
+		const long *v = s->values;
+
+		sample.timestamp = s->timestamp;
+		sample.in[0] = sample_value(v[CORSAIRPSU_REG_IN_SUPPLY]);
+		sample.power[0] = sample_value(v[CORSAIRPSU_REG_POWER_TOTAL]);
+		for (i = 0; i < CORSAIRPSU_RAILS; i++) {
+			sample.in[i + 1] = sample_value(v[CORSAIRPSU_REG_IN_RAIL + i]);
+			sample.curr[i] = sample_value(v[CORSAIRPSU_REG_CURR + i]);
+			sample.power[i + 1] = sample_value(v[CORSAIRPSU_REG_POWER_RAIL + i]);
+		}
+		sample.temp[0] = sample_value(v[CORSAIRPSU_REG_TEMP1]);
+		sample.temp[1] = sample_value(v[CORSAIRPSU_REG_TEMP2]);
+		sample.fan = sample_value(v[CORSAIRPSU_REG_FAN]);
+		sample.curr_supply = sample_value(v[CORSAIRPSU_REG_CURR_SUPPLY]);
+		// the registers this model doesn't answer are never swept
+		for (i = 0; i < ARRAY_SIZE(corsairpsu_sample_regs); i++) {
+			if (test_bit(corsairpsu_sample_regs[i], data->supported)) {
+				sample.valid |= BIT(i);
+			}
+		}
+	}
+
+	if (!kfifo_put(&data->ring, sample)) {
+		data->ring_dropped++;
+		return;
+	}
+	wake_up_interruptible(&data->ring_wait);
+}
+
+static const enum corsairpsu_reg_id corsairpsu_fan_regs[CORSAIRPSU_FAN_WRITES] = {
+	[CORSAIRPSU_FAN_MODE] = CORSAIRPSU_REG_FAN_CONTROL,
+	[CORSAIRPSU_FAN_PWM] = CORSAIRPSU_REG_FAN_PWM,
+};
+
+/*
+	Queue a fan setting for corsairpsu_fan_work(), fan_write_delay ms after the
+	first one queued, a later write of the same setting replaces it meanwhile
+
+	Called with update_lock held.
+*/
+static void corsairpsu_queue_fan(struct corsairpsu_data* data, enum corsairpsu_fan_write w,
+				 int value) {
+	if (data->fan_request[w] >= 0) {
+		atomic_long_inc(&data->stats->fan_writes_coalesced);
+	}
+	data->fan_request[w] = value;
+	if (!data->removing) {
+		queue_delayed_work(system_wq, &data->fan_work, msecs_to_jiffies(fan_write_delay));
+	}
+}
+
+// a fan setting from userspace, which takes the fan back from the curve
+static int corsairpsu_write_fan(struct corsairpsu_data* data, enum corsairpsu_fan_write w,
+				int value) {
+	int ret;
+
+	ret = corsairpsu_lock(data);
+	if (ret < 0) {
+		return ret;
+	}
+
+	data->fan_curve_points = 0;
+	corsairpsu_queue_fan(data, w, value);
+
+	corsairpsu_unlock(data);
+
+	return 0;
+}
+
+// pwm of a curve at temp, flat beyond its ends
+static long corsairpsu_curve_pwm(const struct corsairpsu_curve_point *curve, unsigned int n,
+				 long temp) {
+	const struct corsairpsu_curve_point *lo, *hi;
+	unsigned int i;
+
+	if (temp <= curve[0].temp) {
+		return curve[0].pwm;
+	}
+	for (i = 1; i < n; i++) {
+		if (temp < curve[i].temp) {
+			lo = &curve[i - 1];
+			hi = &curve[i];
+			return lo->pwm + div64_s64((s64)(hi->pwm - lo->pwm) * (temp - lo->temp),
+						   (s64)hi->temp - lo->temp);
+		}
+	}
+
+	return curve[n - 1].pwm;
+}
+
+/*
+	Drive the fan from the curve and the cached temperatures, the hottest of
+	both sensors. Only a duty cycle the PSU doesn't have yet is written.
+
+	Called with update_lock held.
+*/
+static void corsairpsu_apply_fan_curve(struct corsairpsu_data* data) {
+	const long *v = data->snapshot.values;
+	long temp, pwm;
+
+	if (data->fan_curve_points == 0 || !(data->classes_loaded & BIT(CORSAIRPSU_SLOW))) {
+		return;
+	}
+
+	temp = max(v[CORSAIRPSU_REG_TEMP1], v[CORSAIRPSU_REG_TEMP2]);
+	pwm = clamp_val(corsairpsu_curve_pwm(data->fan_curve, data->fan_curve_points, temp), 0, 255);
+
+	corsairpsu_queue_fan(data, CORSAIRPSU_FAN_MODE, 1);
+	corsairpsu_queue_fan(data, CORSAIRPSU_FAN_PWM, DIV_ROUND_CLOSEST(pwm * 100, 255));
+}
+
+// write the queued fan settings the PSU doesn't have yet, the mode first
+static void corsairpsu_fan_work(struct work_struct *work) {
+	struct corsairpsu_data *data = container_of(to_delayed_work(work),
+						    struct corsairpsu_data, fan_work);
+	enum corsairpsu_reg_id reg;
+	int w, value, ret;
+
+	mutex_lock(&data->update_lock);
+
+	for (w = 0; w < CORSAIRPSU_FAN_WRITES; w++) {
+		value = data->fan_request[w];
+		if (value < 0) {
+			continue;
+		}
+		data->fan_request[w] = -1;
+
+		// as last read by a sweep or written
+		reg = corsairpsu_fan_regs[w];
+		if ((data->classes_loaded & BIT(corsairpsu_regs[reg].class)) &&
+		    data->snapshot.values[reg] == value) {
+			atomic_long_inc(&data->stats->fan_writes_skipped);
+			continue;
+		}
+
+		ret = send_recv_cmd(data, 0x02, corsairpsu_regs[reg].opcode, value, NULL, 0);
+		if (ret < 0) {
+			hid_warn(data->hdev, "can't write 0x%02x to register 0x%02x (%d)\n",
+				 value, corsairpsu_regs[reg].opcode, ret);
+			continue;
+		}
+		atomic_long_inc(&data->stats->fan_writes);
+
+		write_seqcount_begin(&data->snapshot_seq);
+		data->snapshot.values[reg] = value;
+		write_seqcount_end(&data->snapshot_seq);
+	}
+
+	corsairpsu_unlock(data);
+}
+
+/*
+	Background sampler, refreshes the snapshot every update_interval ms so
+	readers never wait for the PSU
+*/
+static void corsairpsu_sample_work(struct work_struct *work) {
+	struct corsairpsu_data *data = container_of(to_delayed_work(work),
+						    struct corsairpsu_data, sample_work);
+	unsigned int interval;
+	int ret;
+
+	// restarted by corsairpsu_probe_work() once the PSU is identified
+	if (!smp_load_acquire(&data->ready)) {
+		return;
+	}
+
+	mutex_lock(&data->update_lock);
+	ret = corsairpsu_refresh(data);
+	corsairpsu_push_sample(data, ret == 0 ? &data->snapshot : NULL);
+	if (ret == 0) {
+		corsairpsu_apply_fan_curve(data);
+	}
+	corsairpsu_unlock(data);
+
+	interval = READ_ONCE(data->update_interval);
+	if (interval != 0 && !READ_ONCE(data->removing)) {
+		schedule_delayed_work(&data->sample_work, msecs_to_jiffies(interval));
+	}
+}
+
+// with update_lock, so the sampler isn't restarted once corsairpsu_remove() stopped it
+static void corsairpsu_set_update_interval(struct corsairpsu_data* data, unsigned int interval) {
+	mutex_lock(&data->update_lock);
+	WRITE_ONCE(data->update_interval, interval);
+	if (interval == 0) {
+		cancel_delayed_work(&data->sample_work);
+	} else if (!data->removing) {
+		mod_delayed_work(system_wq, &data->sample_work, 0);
+	}
+	corsairpsu_unlock(data);
+}
+
+/*
+	debugfs corsairpsu/<device>/samples, drains whole struct corsairpsu_sample
+	records, blocking until the sampler produces one unless O_NONBLOCK
+*/
+static ssize_t samples_read(struct file *file, char __user *buf, size_t count,
+			    loff_t *ppos) {
+	struct corsairpsu_data *data = file->private_data;
+	unsigned int copied;
+	int ret;
+
+	if (count < sizeof(struct corsairpsu_sample)) {
+		return -EINVAL;
+	}
+
+	ret = mutex_lock_interruptible(&data->ring_read_lock);
+	if (ret < 0) {
+		return ret;
+	}
+
+	while (kfifo_is_empty(&data->ring)) {
+		if (READ_ONCE(data->removing)) {
+			ret = -ENODEV;
+			goto unlock;
+		}
+		if (file->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto unlock;
+		}
+		ret = wait_event_interruptible(data->ring_wait,
+					       !kfifo_is_empty(&data->ring) ||
+					       READ_ONCE(data->removing));
+		if (ret < 0) {
+			goto unlock;
+		}
+	}
+
+	ret = kfifo_to_user(&data->ring, buf, count, &copied);
+	if (ret == 0) {
+		ret = copied;
+	}
+
+unlock:
+	mutex_unlock(&data->ring_read_lock);
+
+	return ret;
+}
+
+static __poll_t samples_poll(struct file *file, poll_table *wait) {
+	struct corsairpsu_data *data = file->private_data;
+
+	poll_wait(file, &data->ring_wait, wait);
+	if (!kfifo_is_empty(&data->ring)) {
+		return EPOLLIN | EPOLLRDNORM;
+	}
+
+	return 0;
+}
+
+static const struct file_operations samples_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = samples_read,
+	.poll = samples_poll,
+	.llseek = noop_llseek,
+};
+
+/*
+	Restart the power statistics of a channel from its last reading
+
+	Triggered by writing to power[1-4]_reset_history.
+*/
+static int corsairpsu_reset_power_history(struct corsairpsu_data* data, int channel) {
+	int ret;
+
+	ret = corsairpsu_lock(data);
+	if (ret < 0) {
+		return ret;
+	}
+
+	write_seqcount_begin(&data->snapshot_seq);
+	corsairpsu_reset_power_stats(&data->snapshot, channel);
+	data->windows[channel].sum = 0;
+	data->windows[channel].count = 0;
+	data->windows[channel].tail = data->window_head;
+	write_seqcount_end(&data->snapshot_seq);
+
+	corsairpsu_unlock(data);
+
+	return 0;
+}
+
+// change the averaging window of a power channel, in ms
+static int corsairpsu_set_average_interval(struct corsairpsu_data* data, int channel,
+					   unsigned int interval) {
+	int ret;
+
+	ret = corsairpsu_lock(data);
+	if (ret < 0) {
+		return ret;
+	}
+
+	write_seqcount_begin(&data->snapshot_seq);
+	data->windows[channel].interval = interval;
+	corsairpsu_window_expire(data, channel, data->snapshot.timestamp);
+	write_seqcount_end(&data->snapshot_seq);
+
+	corsairpsu_unlock(data);
+
+	return 0;
+}
+
+/*
+	Read a power statistic or the energy of a channel, consistent with the
+	reset_history that may run concurrently
+*/
+static int corsairpsu_read_power_stats(struct device *dev, enum hwmon_sensor_types type,
+				       u32 attr, int channel, long *val) {
+	struct corsairpsu_data *data = dev_get_drvdata(dev);
+	struct corsairpsu_snapshot *s;
+	unsigned int seq;
+
+	s = corsairpsu_update_device(dev);
+	if (IS_ERR(s)) {
+		return PTR_ERR(s);
+	}
+
+	do {
+		seq = read_seqcount_begin(&data->snapshot_seq);
+		if (type == hwmon_energy) {
+			*val = s->power[channel].energy;
+		} else if (attr == hwmon_power_average) {
+			*val = corsairpsu_power_average(data, s, channel);
+		} else if (attr == hwmon_power_input_highest) {
+			*val = s->power[channel].highest;
+		} else {
+			*val = s->power[channel].lowest;
+		}
+	} while (read_seqcount_retry(&data->snapshot_seq, seq));
+
+	return 0;
+}
+
+// transport error counters, one "name value" per line
+static int errors_show(struct seq_file *m, void *unused) {
+	struct corsairpsu_data *data = m->private;
+	struct corsairpsu_errors errors;
+	unsigned long flags;
+
+	spin_lock_irqsave(&data->rx_lock, flags);
+	errors = data->errors;
+	spin_unlock_irqrestore(&data->rx_lock, flags);
+
+	seq_printf(m, "mismatches %lu\n", errors.mismatches);
+	seq_printf(m, "stale %lu\n", errors.stale);
+	seq_printf(m, "timeouts %lu\n", errors.timeouts);
+	seq_printf(m, "send_errors %lu\n", errors.send_errors);
+	seq_printf(m, "resyncs %lu\n", errors.resyncs);
+	seq_printf(m, "handshakes %lu\n", errors.handshakes);
+	seq_printf(m, "recovered %lu\n", errors.recovered);
+	seq_printf(m, "unrecovered %lu\n", errors.unrecovered);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(errors);
+
+static void corsairpsu_hist_show(struct seq_file *m, const char *name,
+				 const struct corsairpsu_hist *hist) {
+	int i;
+
+	seq_puts(m, name);
+	for (i = 0; i < CORSAIRPSU_HIST_BUCKETS; i++) {
+		seq_printf(m, " %d", atomic_read(&hist->buckets[i]));
+	}
+	seq_putc(m, '\n');
+}
+
+static void corsairpsu_hist_reset(struct corsairpsu_hist *hist) {
+	int i;
+
+	for (i = 0; i < CORSAIRPSU_HIST_BUCKETS; i++) {
+		atomic_set(&hist->buckets[i], 0);
+	}
+}
+
+/*
+	Hot path statistics, histograms are log2 buckets of microseconds,
+	<1 1 2 4 ... then everything above, opcodes only once they were sent
+*/
+static int stats_show(struct seq_file *m, void *unused) {
+	struct corsairpsu_data *data = m->private;
+	struct corsairpsu_stats *stats = data->stats;
+	struct corsairpsu_opcode_stats *op;
+	int i;
+
+	seq_printf(m, "cache_hits %ld\n", atomic_long_read(&stats->cache_hits));
+	seq_printf(m, "cache_coalesced %ld\n", atomic_long_read(&stats->cache_coalesced));
+	seq_printf(m, "cache_misses %ld\n", atomic_long_read(&stats->cache_misses));
+	seq_printf(m, "lock_waits %ld\n", atomic_long_read(&stats->lock_waits));
+	seq_printf(m, "lock_wait_ns %lld\n", (long long)atomic64_read(&stats->lock_wait_ns));
+	corsairpsu_hist_show(m, "lock_wait_us", &stats->lock_wait);
+	corsairpsu_hist_show(m, "sweep_us", &stats->sweep);
+	seq_printf(m, "ring_dropped %lu\n", READ_ONCE(data->ring_dropped));
+	seq_printf(m, "fan_writes %ld\n", atomic_long_read(&stats->fan_writes));
+	seq_printf(m, "fan_writes_coalesced %ld\n", atomic_long_read(&stats->fan_writes_coalesced));
+	seq_printf(m, "fan_writes_skipped %ld\n", atomic_long_read(&stats->fan_writes_skipped));
+
+	for (i = 0; i < ARRAY_SIZE(stats->opcodes); i++) {
+		op = &stats->opcodes[i];
+		if (atomic_long_read(&op->count) == 0) {
+			continue;
+		}
+		seq_printf(m, "opcode 0x%02x count %ld errors %ld retries %ld\n", i,
+			   atomic_long_read(&op->count), atomic_long_read(&op->errors),
+			   atomic_long_read(&op->retries));
+		corsairpsu_hist_show(m, "latency_us", &op->latency);
+	}
+
+	return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file) {
+	return single_open(file, stats_show, inode->i_private);
+}
+
+// writing anything resets the statistics
+static ssize_t stats_write(struct file *file, const char __user *buf, size_t count,
+			   loff_t *ppos) {
+	struct corsairpsu_data *data = ((struct seq_file *)file->private_data)->private;
+	struct corsairpsu_stats *stats = data->stats;
+	int i;
+
+	atomic_long_set(&stats->cache_hits, 0);
+	atomic_long_set(&stats->cache_coalesced, 0);
+	atomic_long_set(&stats->cache_misses, 0);
+	atomic_long_set(&stats->lock_waits, 0);
+	atomic64_set(&stats->lock_wait_ns, 0);
+	corsairpsu_hist_reset(&stats->lock_wait);
+	corsairpsu_hist_reset(&stats->sweep);
+	atomic_long_set(&stats->fan_writes, 0);
+	atomic_long_set(&stats->fan_writes_coalesced, 0);
+	atomic_long_set(&stats->fan_writes_skipped, 0);
+	for (i = 0; i < ARRAY_SIZE(stats->opcodes); i++) {
+		atomic_long_set(&stats->opcodes[i].count, 0);
+		atomic_long_set(&stats->opcodes[i].errors, 0);
+		atomic_long_set(&stats->opcodes[i].retries, 0);
+		corsairpsu_hist_reset(&stats->opcodes[i].latency);
+	}
+
+	return count;
+}
+
+static const struct file_operations stats_fops = {
+	.owner = THIS_MODULE,
+	.open = stats_open,
+	.read = seq_read,
+	.write = stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void corsairpsu_aggregate_work(struct work_struct *work) {
+	struct corsairpsu_data *data = container_of(work, struct corsairpsu_data, aggregate_work);
+
+	data->aggregate_ret = PTR_ERR_OR_ZERO(corsairpsu_update_device(data->hwmon_dev));
+}
+
+/*
+	Aggregate of all the PSUs, e.g. the redundant supplies of a server, from
+	their snapshots refreshed in parallel: total of the power the PSUs report
+	and AC side power in uW, total energy in uJ and highest temperature in
+	millidegrees, then per PSU. The AC side total is only there when every
+	PSU answers READ_IIN.
+*/
+static int aggregate_show(struct seq_file *m, void *unused) {
+	struct corsairpsu_data *data;
+	const struct corsairpsu_snapshot *s;
+	long power = 0, power_in = 0, temp_max = LONG_MIN;
+	long dev_power, dev_power_in, dev_temp;
+	u64 energy = 0, dev_energy;
+	unsigned int devices = 0, responding = 0, with_power_in = 0;
+	unsigned int seq;
+
+	mutex_lock(&corsairpsu_registry_lock);
+
+	list_for_each_entry(data, &corsairpsu_registry, registry) {
+		queue_work(system_unbound_wq, &data->aggregate_work);
+	}
+	list_for_each_entry(data, &corsairpsu_registry, registry) {
+		flush_work(&data->aggregate_work);
+	}
+
+	list_for_each_entry(data, &corsairpsu_registry, registry) {
+		devices++;
+		if (data->aggregate_ret < 0) {
+			seq_printf(m, "device %s error %d\n", dev_name(&data->hdev->dev),
+				   data->aggregate_ret);
+			continue;
+		}
+		responding++;
+
+		s = &data->snapshot;
+		do {
+			seq = read_seqcount_begin(&data->snapshot_seq);
+			dev_power = s->values[CORSAIRPSU_REG_POWER_TOTAL];
+			dev_power_in = s->power_in;
+			dev_energy = s->power[0].energy;
+			dev_temp = max(s->values[CORSAIRPSU_REG_TEMP1], s->values[CORSAIRPSU_REG_TEMP2]);
+		} while (read_seqcount_retry(&data->snapshot_seq, seq));
+
+		power += dev_power;
+		energy += dev_energy;
+		temp_max = max(temp_max, dev_temp);
+		seq_printf(m, "device %s power_total %ld", dev_name(&data->hdev->dev), dev_power);
+		if (corsairpsu_has_power_in(data)) {
+			power_in += dev_power_in;
+			with_power_in++;
+			seq_printf(m, " power_in %ld", dev_power_in);
+		}
+		seq_printf(m, " energy %llu temp %ld\n", dev_energy, dev_temp);
+	}
+
+	mutex_unlock(&corsairpsu_registry_lock);
+
+	seq_printf(m, "devices %u\n", devices);
+	seq_printf(m, "responding %u\n", responding);
+	seq_printf(m, "power_total %ld\n", power);
+	if (responding > 0 && with_power_in == responding) {
+		seq_printf(m, "power_in %ld\n", power_in);
+	}
+	seq_printf(m, "energy %llu\n", energy);
+	if (responding > 0) {
+		seq_printf(m, "temp_max %ld\n", temp_max);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aggregate);
+
+// results of the last vector written through an open pmbus file
+struct corsairpsu_pmbus {
+	struct corsairpsu_data *data;
+	struct mutex lock;			// protects the fields below
+	u8 *result;
+	size_t size;
+};
+
+/*
+	Run the reads through the batch engine under update_lock, so they share
+	the PSU with the sweeps, the consecutive ones of a page in one batch
+*/
+static int corsairpsu_pmbus_run(struct corsairpsu_data *data,
+				const struct corsairpsu_pmbus_read *reads, unsigned int count,
+				u8 *result) {
+	struct corsairpsu_pmbus_result *res[CORSAIRPSU_PMBUS_MAX_READS];
+	struct corsairpsu_cmd *cmds;
+	unsigned int i, first;
+	size_t offset = 0;
+	int ret;
+
+	cmds = kcalloc(count, sizeof(*cmds), GFP_KERNEL);
+	if (cmds == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		res[i] = (struct corsairpsu_pmbus_result *)(result + offset);
+		res[i]->page = reads[i].page;
+		res[i]->opcode = reads[i].opcode;
+		res[i]->len = reads[i].len;
+		offset += sizeof(*res[i]) + reads[i].len;
+
+		cmds[i].addr = 0x03;
+		cmds[i].opcode = reads[i].opcode;
+		cmds[i].dst = res[i] + 1;
+		cmds[i].len = reads[i].len;
+		cmds[i].status = -EIO;			// until sent
+	}
+
+	ret = corsairpsu_lock(data);
+	if (ret < 0) {
+		kfree(cmds);
+		return ret;
+	}
+	for (first = 0; first < count; first = i) {
+		for (i = first + 1; i < count && reads[i].page == reads[first].page; i++)
+			;
+		send_recv_batch(data, reads[first].page, &cmds[first], i - first);
+	}
+	corsairpsu_unlock(data);
+
+	for (i = 0; i < count; i++) {
+		res[i]->status = cmds[i].status;
+		if (cmds[i].status < 0) {
+			memset(res[i] + 1, 0, reads[i].len);
+		}
+	}
+
+	kfree(cmds);
+	return 0;
+}
+
+static int pmbus_open(struct inode *inode, struct file *file) {
+	struct corsairpsu_pmbus *pmbus;
+
+	pmbus = kzalloc(sizeof(*pmbus), GFP_KERNEL);
+	if (pmbus == NULL)
+		return -ENOMEM;
+	pmbus->data = inode->i_private;
+	mutex_init(&pmbus->lock);
+	file->private_data = pmbus;
+
+	return nonseekable_open(inode, file);
+}
+
+static ssize_t pmbus_write(struct file *file, const char __user *buf, size_t count,
+			   loff_t *ppos) {
+	struct corsairpsu_pmbus *pmbus = file->private_data;
+	struct corsairpsu_pmbus_read *reads;
+	unsigned int n = count / sizeof(*reads), i;
+	size_t size = 0;
+	u8 *result;
+	int ret;
+
+	if (count == 0 || count % sizeof(*reads) != 0 || n > CORSAIRPSU_PMBUS_MAX_READS)
+		return -EINVAL;
+	if (!smp_load_acquire(&pmbus->data->ready))
+		return -EAGAIN;
+
+	reads = memdup_user(buf, count);
+	if (IS_ERR(reads))
+		return PTR_ERR(reads);
+
+	for (i = 0; i < n; i++) {
+		if (reads[i].page < CORSAIRPSU_PAGE_UNKNOWN || reads[i].page >= CORSAIRPSU_RAILS ||
+		    reads[i].len == 0 || reads[i].len > CORSAIRPSU_PMBUS_MAX_LEN) {
+			kfree(reads);
+			return -EINVAL;
+		}
+		size += sizeof(struct corsairpsu_pmbus_result) + reads[i].len;
+	}
+
+	result = kzalloc(size, GFP_KERNEL);
+	if (result == NULL) {
+		kfree(reads);
+		return -ENOMEM;
+	}
+
+	ret = corsairpsu_pmbus_run(pmbus->data, reads, n, result);
+	kfree(reads);
+	if (ret < 0) {
+		kfree(result);
+		return ret;
+	}
+
+	// the next reads start at the first result
+	mutex_lock(&pmbus->lock);
+	kfree(pmbus->result);
+	pmbus->result = result;
+	pmbus->size = size;
+	*ppos = 0;
+	mutex_unlock(&pmbus->lock);
+
+	return count;
+}
+
+// the results of the last write, 0 once they were all read
+static ssize_t pmbus_read(struct file *file, char __user *buf, size_t count, loff_t *ppos) {
+	struct corsairpsu_pmbus *pmbus = file->private_data;
+	ssize_t ret;
+
+	mutex_lock(&pmbus->lock);
+	ret = simple_read_from_buffer(buf, count, ppos, pmbus->result, pmbus->size);
+	mutex_unlock(&pmbus->lock);
+
+	return ret;
+}
+
+static int pmbus_release(struct inode *inode, struct file *file) {
+	struct corsairpsu_pmbus *pmbus = file->private_data;
+
+	kfree(pmbus->result);
+	kfree(pmbus);
+
+	return 0;
+}
+
+static const struct file_operations pmbus_fops = {
+	.owner = THIS_MODULE,
+	.open = pmbus_open,
+	.read = pmbus_read,
+	.write = pmbus_write,
+	.release = pmbus_release,
+};
+
+#ifdef CORSAIRPSU_MOCK
+#define CORSAIRPSU_BENCH_MAX_READERS	64
+
+// one of the concurrent readers of a benchmark run
+struct corsairpsu_bench_reader {
+	struct work_struct work;
+	struct corsairpsu_data *data;
+	unsigned int iterations;
+	unsigned long errors;
+	s64 min, max, total;			// read latency in ns
+};
+
+static void corsairpsu_bench_work(struct work_struct *work) {
+	struct corsairpsu_bench_reader *reader = container_of(work, struct corsairpsu_bench_reader, work);
+	struct corsairpsu_snapshot *s;
+	ktime_t start;
+	s64 ns;
+	int i;
+
+	reader->min = S64_MAX;
+	for (i = 0; i < reader->iterations; i++) {
+		start = ktime_get();
+		s = corsairpsu_update_device(reader->data->hwmon_dev);
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		if (IS_ERR(s)) {
+			reader->errors++;
+		}
+		reader->min = min(reader->min, ns);
+		reader->max = max(reader->max, ns);
+		reader->total += ns;
+	}
+}
+
+// round trips sent to the PSU so far, retries included
+static unsigned long corsairpsu_bench_round_trips(struct corsairpsu_data *data) {
+	unsigned long round_trips = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(data->stats->opcodes); i++) {
+		round_trips += atomic_long_read(&data->stats->opcodes[i].count);
+	}
+
+	return round_trips;
+}
+
+// run readers concurrent readers of iterations sensors reads each, and keep the results
+static int corsairpsu_bench_run(struct corsairpsu_data *data, unsigned int readers,
+				unsigned int iterations) {
+	struct corsairpsu_bench *bench = &data->bench;
+	struct corsairpsu_bench_reader *reader;
+	unsigned long generation, round_trips, lock_waits;
+	ktime_t start;
+	int i;
+
+	reader = kcalloc(readers, sizeof(*reader), GFP_KERNEL);
+	if (reader == NULL)
+		return -ENOMEM;
+
+	generation = READ_ONCE(data->generation);
+	round_trips = corsairpsu_bench_round_trips(data);
+	lock_waits = atomic_long_read(&data->stats->lock_waits);
+
+	start = ktime_get();
+	for (i = 0; i < readers; i++) {
+		reader[i].data = data;
+		reader[i].iterations = iterations;
+		INIT_WORK(&reader[i].work, corsairpsu_bench_work);
+		queue_work(system_unbound_wq, &reader[i].work);
+	}
+	for (i = 0; i < readers; i++) {
+		flush_work(&reader[i].work);
+	}
+
+	bench->readers = readers;
+	bench->iterations = iterations;
+	bench->duration = ktime_to_ns(ktime_sub(ktime_get(), start));
+	bench->reads = (unsigned long)readers * iterations;
+	bench->errors = 0;
+	bench->sweeps = READ_ONCE(data->generation) - generation;
+	bench->round_trips = corsairpsu_bench_round_trips(data) - round_trips;
+	bench->lock_waits = atomic_long_read(&data->stats->lock_waits) - lock_waits;
+	bench->min = S64_MAX;
+	bench->max = 0;
+	bench->total = 0;
+	for (i = 0; i < readers; i++) {
+		bench->errors += reader[i].errors;
+		bench->min = min(bench->min, reader[i].min);
+		bench->max = max(bench->max, reader[i].max);
+		bench->total += reader[i].total;
+	}
+
+	kfree(reader);
+	return 0;
+}
+
+/*
+	Results of the last run, a sensors read is a corsairpsu_update_device() call,
+	round trips are the commands sent to the PSU, retries included
+*/
+static int bench_show(struct seq_file *m, void *unused) {
+	struct corsairpsu_data *data = m->private;
+	struct corsairpsu_bench *bench = &data->bench;
+
+	mutex_lock(&bench->lock);
+	if (bench->reads > 0) {
+		seq_printf(m, "readers %u\n", bench->readers);
+		seq_printf(m, "iterations %u\n", bench->iterations);
+		seq_printf(m, "duration_ns %lld\n", bench->duration);
+		seq_printf(m, "reads %lu\n", bench->reads);
+		seq_printf(m, "errors %lu\n", bench->errors);
+		seq_printf(m, "sweeps %lu\n", bench->sweeps);
+		seq_printf(m, "round_trips %lu\n", bench->round_trips);
+		seq_printf(m, "round_trips_per_read %lu.%02lu\n",
+			   bench->round_trips / bench->reads,
+			   bench->round_trips * 100 / bench->reads % 100);
+		seq_printf(m, "round_trips_per_sweep %lu\n",
+			   bench->sweeps ? bench->round_trips / bench->sweeps : 0);
+		seq_printf(m, "lock_waits %lu\n", bench->lock_waits);
+		seq_printf(m, "latency_ns min %lld avg %lld max %lld\n", bench->min,
+			   div_s64(bench->total, bench->reads), bench->max);
+	}
+	mutex_unlock(&bench->lock);
+
+	return 0;
+}
+
+static int bench_open(struct inode *inode, struct file *file) {
+	return single_open(file, bench_show, inode->i_private);
+}
+
+// writing "readers iterations" runs the benchmark, returning once it is done
+static ssize_t bench_write(struct file *file, const char __user *buf, size_t count,
+			   loff_t *ppos) {
+	struct corsairpsu_data *data = ((struct seq_file *)file->private_data)->private;
+	unsigned int readers, iterations;
+	char kbuf[32] = { 0 };
+	int ret;
+
+	if (count >= sizeof(kbuf))
+		return -EINVAL;
+	if (copy_from_user(kbuf, buf, count))
+		return -EFAULT;
+	if (sscanf(kbuf, "%u %u", &readers, &iterations) != 2)
+		return -EINVAL;
+	if (readers == 0 || readers > CORSAIRPSU_BENCH_MAX_READERS || iterations == 0)
+		return -EINVAL;
+
+	// the readers need the hwmon device, right after insmod too
+	flush_work(&data->probe_work);
+	if (!smp_load_acquire(&data->ready))
+		return -EAGAIN;
+
+	mutex_lock(&data->bench.lock);
+	ret = corsairpsu_bench_run(data, readers, iterations);
+	mutex_unlock(&data->bench.lock);
+
+	return ret < 0 ? ret : count;
+}
+
+static const struct file_operations bench_fops = {
+	.owner = THIS_MODULE,
+	.open = bench_open,
+	.read = seq_read,
+	.write = bench_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+#endif
+
+static umode_t corsairpsu_is_visible(const void *rdata, enum hwmon_sensor_types type,
+										u32 attr, int channel);
+
+/*
+	The attributes are registered once the PSU is identified, only those this
+	model backs, and are -EAGAIN until corsairpsu_probe_work() is done with it
+*/
+static int corsairpsu_attr_status(const struct corsairpsu_data *data,
+				  enum hwmon_sensor_types type, u32 attr, int channel) {
+	if (type == hwmon_chip) {
+		return 0;
+	}
+	if (!smp_load_acquire(&data->ready)) {
+		return -EAGAIN;
+	}
+	if (corsairpsu_is_visible(data, type, attr, channel) == 0) {
+		return -ENODATA;
+	}
+
+	return 0;
+}
+
+static int corsairpsu_read(struct device *dev, enum hwmon_sensor_types type,
+							u32 attr, int channel, long *val) {
+
+	struct corsairpsu_data *data = dev_get_drvdata(dev);
+	struct corsairpsu_snapshot *s;
+	int reg, alarm, ret;
+
+	ret = corsairpsu_attr_status(data, type, attr, channel);
+	if (ret < 0) {
+		return ret;
+	}
+
+	switch (type) {
+		// Chip
+		case hwmon_chip:
+			switch (attr) {
+				case hwmon_chip_update_interval: // sampler period (millisecond)
+					*val = data->update_interval;
+					break;
+				default:
+					return -EOPNOTSUPP;
+			}
+			break;
+
+		// Energy (microjoule) and power statistics (microwatt)
+		case hwmon_energy:
+			return corsairpsu_read_power_stats(dev, type, attr, channel, val);
+
+		// Fan PWM (0-255) and mode (1 for manual, 2 for automatic)
+		case hwmon_pwm:
+			s = corsairpsu_update_device(dev);
+			if (IS_ERR(s)) {
+				return PTR_ERR(s);
+			}
+			if (attr == hwmon_pwm_enable) {
+				*val = s->values[CORSAIRPSU_REG_FAN_CONTROL] ? 1 : 2;
+			} else {
+				*val = DIV_ROUND_CLOSEST(s->values[CORSAIRPSU_REG_FAN_PWM] * 255, 100);
+			}
+			break;
+
+		// Temperatures (millidegree Celsius), Fan (RPM), Voltage (millivolt),
+		// Current (milliamp), Power (microwatt)
+		case hwmon_temp:
+		case hwmon_fan:
+		case hwmon_in:
+		case hwmon_curr:
+		case hwmon_power:
+			// alarms (boolean), from the status registers
+			alarm = corsairpsu_find_alarm(type, attr, channel);
+			if (alarm >= 0) {
+				s = corsairpsu_update_device(dev);
+				if (IS_ERR(s)) {
+					return PTR_ERR(s);
+				}
+				*val = corsairpsu_alarm_raised(&corsairpsu_alarms[alarm], s);
+				break;
+			}
+			if (type == hwmon_power && (attr == hwmon_power_average ||
+						    attr == hwmon_power_input_highest ||
+						    attr == hwmon_power_input_lowest)) {
+				return corsairpsu_read_power_stats(dev, type, attr, channel, val);
+			}
+			if (type == hwmon_power && channel == CORSAIRPSU_POWER_IN) {
+				s = corsairpsu_update_device(dev);
+				if (IS_ERR(s)) {
+					return PTR_ERR(s);
+				}
+				*val = s->power_in;
+				break;
+			}
+			if (type == hwmon_power && attr == hwmon_power_average_interval) {
+				*val = READ_ONCE(data->windows[channel].interval);
+				break;
+			}
+			reg = corsairpsu_find_reg(type, attr, channel);
+			if (reg < 0) {
+				return -EOPNOTSUPP;
+			}
+			// limits are read once and for all
+			if (corsairpsu_regs[reg].class == CORSAIRPSU_STATIC &&
+			    (READ_ONCE(data->classes_loaded) & BIT(CORSAIRPSU_STATIC))) {
+				*val = data->snapshot.values[reg];
+				break;
+			}
+			s = corsairpsu_update_device(dev);
+			if (IS_ERR(s)) {
+				return PTR_ERR(s);
+			}
+			*val = s->values[reg];
+			break;
+
+		default:
+			return -EOPNOTSUPP;
+	}
+
+	return 0;
+}
+
+static const char *corsairpsu_chip_label[] = {
+	"total uptime",
+	"uptime",
+};
+
+static const char *corsairpsu_temp_label[] = {
+	"temp1",
+	"temp2",
 };
 
 static const char *corsairpsu_fan_label[] = {
@@ -619,6 +2585,7 @@ static const char *corsairpsu_curr_label[] = {
 	"current 12v",
 	"current 5v",
 	"current 3.3v",
+	"current supply",
 };
 
 static const char *corsairpsu_power_label[] = {
@@ -626,11 +2593,26 @@ static const char *corsairpsu_power_label[] = {
 	"power 12v",
 	"power 5v",
 	"power 3.3v",
+	"power input",
+};
+
+static const char *corsairpsu_energy_label[] = {
+	"energy total",
+	"energy 12v",
+	"energy 5v",
+	"energy 3.3v",
 };
 
 static int corsairpsu_read_labels(struct device *dev,
 				enum hwmon_sensor_types type, u32 attr,
 				int channel, const char **str) {
+	int ret;
+
+	ret = corsairpsu_attr_status(dev_get_drvdata(dev), type, attr, channel);
+	if (ret < 0) {
+		return ret;
+	}
+
 	switch (type) {
 		case hwmon_chip:
 			*str = corsairpsu_chip_label[channel];
@@ -647,8 +2629,199 @@ static int corsairpsu_read_labels(struct device *dev,
 		case hwmon_curr:
 			*str = corsairpsu_curr_label[channel];
 			break;
-		case hwmon_power:
-			*str = corsairpsu_power_label[channel];
+		case hwmon_power:
+			*str = corsairpsu_power_label[channel];
+			break;
+		case hwmon_energy:
+			*str = corsairpsu_energy_label[channel];
+			break;
+		default:
+			return -EOPNOTSUPP;
+	}
+
+	return 0;
+}
+
+static const struct hwmon_channel_info *corsairpsu_info[] = {
+	HWMON_CHANNEL_INFO(chip,
+		HWMON_C_UPDATE_INTERVAL),
+
+	HWMON_CHANNEL_INFO(temp,					//TODO: use RATED_MAX on kernel 5.10
+		HWMON_T_INPUT | HWMON_T_LABEL | HWMON_T_MAX |
+		HWMON_T_ALARM | HWMON_T_CRIT_ALARM,			// temp1
+		HWMON_T_INPUT | HWMON_T_LABEL | HWMON_T_MAX |
+		HWMON_T_ALARM | HWMON_T_CRIT_ALARM),			// temp2
+
+	HWMON_CHANNEL_INFO(fan,
+		HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_ALARM | HWMON_F_FAULT),		// fan rpm
+
+	HWMON_CHANNEL_INFO(pwm,
+		HWMON_PWM_INPUT | HWMON_PWM_ENABLE),		// fan pwm and mode
+
+	HWMON_CHANNEL_INFO(in, //TODO: use RATED_MAX/MIN on kernel 5.10
+		HWMON_I_INPUT | HWMON_I_LABEL | HWMON_I_ALARM | HWMON_I_LCRIT_ALARM,	// voltage supply
+		HWMON_I_INPUT | HWMON_I_LABEL | HWMON_I_MAX | HWMON_I_MIN |
+		HWMON_I_ALARM | HWMON_I_CRIT_ALARM,					// voltage 12v
+		HWMON_I_INPUT | HWMON_I_LABEL | HWMON_I_MAX | HWMON_I_MIN |
+		HWMON_I_ALARM | HWMON_I_CRIT_ALARM,					// voltage 5v
+		HWMON_I_INPUT | HWMON_I_LABEL | HWMON_I_MAX | HWMON_I_MIN |
+		HWMON_I_ALARM | HWMON_I_CRIT_ALARM),					// voltage 3.3v
+
+	HWMON_CHANNEL_INFO(curr, //TODO: use RATED_MAX/MIN on kernel 5.10
+		HWMON_C_INPUT | HWMON_C_LABEL | HWMON_C_MAX |
+		HWMON_C_ALARM | HWMON_C_CRIT_ALARM,		// current 12v
+		HWMON_C_INPUT | HWMON_C_LABEL | HWMON_C_MAX |
+		HWMON_C_ALARM | HWMON_C_CRIT_ALARM,		// current 5v
+		HWMON_C_INPUT | HWMON_C_LABEL | HWMON_C_MAX |
+		HWMON_C_ALARM | HWMON_C_CRIT_ALARM,		// current 3.3v
+		HWMON_C_INPUT | HWMON_C_LABEL),			// current supply
+
+	HWMON_CHANNEL_INFO(power,
+		HWMON_P_INPUT | HWMON_P_LABEL | HWMON_P_AVERAGE | HWMON_P_AVERAGE_INTERVAL |
+		HWMON_P_INPUT_HIGHEST | HWMON_P_INPUT_LOWEST | HWMON_P_RESET_HISTORY,		// power total
+		HWMON_P_INPUT | HWMON_P_LABEL | HWMON_P_AVERAGE | HWMON_P_AVERAGE_INTERVAL |
+		HWMON_P_INPUT_HIGHEST | HWMON_P_INPUT_LOWEST | HWMON_P_RESET_HISTORY,		// power 12v
+		HWMON_P_INPUT | HWMON_P_LABEL | HWMON_P_AVERAGE | HWMON_P_AVERAGE_INTERVAL |
+		HWMON_P_INPUT_HIGHEST | HWMON_P_INPUT_LOWEST | HWMON_P_RESET_HISTORY,		// power 5v
+		HWMON_P_INPUT | HWMON_P_LABEL | HWMON_P_AVERAGE | HWMON_P_AVERAGE_INTERVAL |
+		HWMON_P_INPUT_HIGHEST | HWMON_P_INPUT_LOWEST | HWMON_P_RESET_HISTORY,		// power 3.3v
+		HWMON_P_INPUT | HWMON_P_LABEL),			// power input, AC side
+
+	HWMON_CHANNEL_INFO(energy,
+		HWMON_E_INPUT | HWMON_E_LABEL,		// energy total
+		HWMON_E_INPUT | HWMON_E_LABEL,		// energy 12v
+		HWMON_E_INPUT | HWMON_E_LABEL,		// energy 5v
+		HWMON_E_INPUT | HWMON_E_LABEL),		// energy 3.3v
+
+	NULL
+};
+
+// whether a supported register backs a hwmon attribute
+static bool corsairpsu_attr_supported(const struct corsairpsu_data *data,
+				      enum hwmon_sensor_types type, u32 attr, int channel) {
+	int reg = corsairpsu_find_reg(type, attr, channel);
+
+	return reg >= 0 && test_bit(reg, data->supported);
+}
+
+static umode_t corsairpsu_is_visible(const void *rdata, enum hwmon_sensor_types type,
+										u32 attr, int channel) {
+	const struct corsairpsu_data *data = rdata;
+	int alarm;
+
+	switch (type) {
+		case hwmon_chip:
+			return attr == hwmon_chip_update_interval ? 0644 : 0;
+		case hwmon_temp:
+			if (attr == hwmon_temp_label)
+				return corsairpsu_attr_supported(data, type, hwmon_temp_input, channel) ? 0444 : 0;
+			break;
+		case hwmon_fan:
+			if (attr == hwmon_fan_label)
+				return corsairpsu_attr_supported(data, type, hwmon_fan_input, channel) ? 0444 : 0;
+			break;
+		case hwmon_in:
+			if (attr == hwmon_in_label)
+				return corsairpsu_attr_supported(data, type, hwmon_in_input, channel) ? 0444 : 0;
+			break;
+		case hwmon_curr:
+			if (attr == hwmon_curr_label)
+				return corsairpsu_attr_supported(data, type, hwmon_curr_input, channel) ? 0444 : 0;
+			break;
+		case hwmon_power:
+			// the AC side needs the input voltage and current
+			if (channel == CORSAIRPSU_POWER_IN) {
+				return corsairpsu_has_power_in(data) ? 0444 : 0;
+			}
+			// the statistics only need the power reading
+			if (attr != hwmon_power_input &&
+			    !corsairpsu_attr_supported(data, type, hwmon_power_input, channel)) {
+				return 0;
+			}
+			switch (attr) {
+				case hwmon_power_label:
+				case hwmon_power_average:
+				case hwmon_power_input_highest:
+				case hwmon_power_input_lowest:
+					return 0444;
+				case hwmon_power_average_interval:
+					return 0644;
+				case hwmon_power_reset_history:
+					return 0200;
+			}
+			break;
+		case hwmon_energy:
+			return corsairpsu_attr_supported(data, hwmon_power, hwmon_power_input, channel) ? 0444 : 0;
+		case hwmon_pwm:
+			if (attr == hwmon_pwm_enable)
+				return test_bit(CORSAIRPSU_REG_FAN_CONTROL, data->supported) ? 0644 : 0;
+			return corsairpsu_attr_supported(data, type, attr, channel) ? 0644 : 0;
+		default:
+			return 0;
+	}
+
+	alarm = corsairpsu_find_alarm(type, attr, channel);
+	if (alarm >= 0) {
+		return test_bit(corsairpsu_alarms[alarm].reg, data->supported) ? 0444 : 0;
+	}
+
+	// read-only for everybody, if a supported register backs it
+	return corsairpsu_attr_supported(data, type, attr, channel) ? 0444 : 0;
+}
+
+static int corsairpsu_write(struct device *dev, enum hwmon_sensor_types type,
+							u32 attr, int channel, long val) {
+	struct corsairpsu_data *data = dev_get_drvdata(dev);
+	int ret;
+
+	ret = corsairpsu_attr_status(data, type, attr, channel);
+	if (ret < 0) {
+		return ret;
+	}
+
+	switch (type) {
+		case hwmon_chip:
+			switch (attr) {
+				case hwmon_chip_update_interval: // 0 stops the sampler
+					if (val < 0) {
+						return -EINVAL;
+					}
+					corsairpsu_set_update_interval(data, clamp_val(val, 0, UINT_MAX));
+					break;
+				default:
+					return -EOPNOTSUPP;
+			}
+			break;
+		case hwmon_power:
+			switch (attr) {
+				case hwmon_power_average_interval: // 0 averages since reset_history
+					if (val < 0) {
+						return -EINVAL;
+					}
+					return corsairpsu_set_average_interval(data, channel,
+									       clamp_val(val, 0, UINT_MAX));
+				case hwmon_power_reset_history: // any value
+					return corsairpsu_reset_power_history(data, channel);
+				default:
+					return -EOPNOTSUPP;
+			}
+			break;
+		case hwmon_pwm:
+			switch (attr) {
+				case hwmon_pwm_input: // 0-255, applied in manual mode
+					if (val < 0 || val > 255) {
+						return -EINVAL;
+					}
+					return corsairpsu_write_fan(data, CORSAIRPSU_FAN_PWM,
+								    DIV_ROUND_CLOSEST(val * 100, 255));
+				case hwmon_pwm_enable: // 1 for manual, 2 for automatic
+					if (val != 1 && val != 2) {
+						return -EINVAL;
+					}
+					return corsairpsu_write_fan(data, CORSAIRPSU_FAN_MODE, val == 1);
+				default:
+					return -EOPNOTSUPP;
+			}
 			break;
 		default:
 			return -EOPNOTSUPP;
@@ -657,44 +2830,11 @@ static int corsairpsu_read_labels(struct device *dev,
 	return 0;
 }
 
-static const struct hwmon_channel_info *corsairpsu_info[] = {
-	HWMON_CHANNEL_INFO(temp,					//TODO: use RATED_MAX on kernel 5.10
-		HWMON_T_INPUT | HWMON_T_LABEL | HWMON_T_MAX,		// temp1 
-		HWMON_T_INPUT | HWMON_T_LABEL | HWMON_T_MAX),		// temp2
-
-	HWMON_CHANNEL_INFO(fan,
-		HWMON_F_INPUT | HWMON_F_LABEL),		// fan rpm
-
-	HWMON_CHANNEL_INFO(in, //TODO: use RATED_MAX/MIN on kernel 5.10
-		HWMON_I_INPUT | HWMON_I_LABEL,	// voltage supply
-		HWMON_I_INPUT | HWMON_I_LABEL | HWMON_I_MAX | HWMON_I_MIN,		// voltage 12v
-		HWMON_I_INPUT | HWMON_I_LABEL | HWMON_I_MAX | HWMON_I_MIN,		// voltage 5v
-		HWMON_I_INPUT | HWMON_I_LABEL | HWMON_I_MAX | HWMON_I_MIN),		// voltage 3.3v
-
-	HWMON_CHANNEL_INFO(curr, //TODO: use RATED_MAX/MIN on kernel 5.10
-		HWMON_C_INPUT | HWMON_C_LABEL | HWMON_C_MAX,		// current 12v
-		HWMON_C_INPUT | HWMON_C_LABEL | HWMON_C_MAX,		// current 5v
-		HWMON_C_INPUT | HWMON_C_LABEL | HWMON_C_MAX),		// current 3.3v
-
-	HWMON_CHANNEL_INFO(power,
-		HWMON_P_INPUT | HWMON_P_LABEL,		// power total
-		HWMON_P_INPUT | HWMON_P_LABEL,		// power 12v
-		HWMON_P_INPUT | HWMON_P_LABEL,		// power 5v
-		HWMON_P_INPUT | HWMON_P_LABEL),		// power 3.3v
-
-	NULL
-};
-
-static umode_t corsairpsu_is_visible(const void *rdata, enum hwmon_sensor_types type,
-										u32 attr, int channel) {
-	// read-only for everybody
-	return 0444;
-}
-
 static const struct hwmon_ops corsairpsu_hwmon_ops = {
 	.is_visible = corsairpsu_is_visible,
 	.read = corsairpsu_read,
 	.read_string = corsairpsu_read_labels,
+	.write = corsairpsu_write,
 };
 
 static const struct hwmon_chip_info corsairpsu_chip_info = {
@@ -702,15 +2842,17 @@ static const struct hwmon_chip_info corsairpsu_chip_info = {
 	.info = corsairpsu_info,
 };
 
-// helper to read a custom attribute
+// helper to read a custom attribute from the snapshot
 static ssize_t u32_show(struct device *dev, struct device_attribute *attr,
-						char *buf, u16 opcode) {
+						char *buf, enum corsairpsu_reg_id reg) {
 	int len = 0;
-	struct corsairpsu_data *data = dev_get_drvdata(dev);
-	u32 reading;
+	struct corsairpsu_snapshot *s;
 
-	send_recv_cmd(data, 0x03, opcode, 0x00, &reading, sizeof(u32));
-	len += sprintf(buf, "%u\n", reading);
+	s = corsairpsu_update_device(dev);
+	if (IS_ERR(s)) {
+		return PTR_ERR(s);
+	}
+	len += sprintf(buf, "%u\n", (u32)s->values[reg]);
 
 	return len;
 }
@@ -718,14 +2860,14 @@ static ssize_t u32_show(struct device *dev, struct device_attribute *attr,
 // total PSU uptime in seconds
 static ssize_t total_uptime_show(struct device *dev, struct device_attribute *attr,
 								char *buf) {
-	return u32_show(dev, attr, buf, 0xD1);
+	return u32_show(dev, attr, buf, CORSAIRPSU_REG_TOTAL_UPTIME);
 }
 static DEVICE_ATTR_RO(total_uptime);
 
 // current PSU uptime in seconds
 static ssize_t current_uptime_show(struct device *dev,
 				struct device_attribute *attr, char *buf) {
-	return u32_show(dev, attr, buf, 0xD2);
+	return u32_show(dev, attr, buf, CORSAIRPSU_REG_CURRENT_UPTIME);
 }
 static DEVICE_ATTR_RO(current_uptime);
 
@@ -733,7 +2875,7 @@ static DEVICE_ATTR_RO(current_uptime);
 // 1 for single rail, 2 for multi rail
 static ssize_t ocp_mode_show(struct device *dev, struct device_attribute *attr,
 							char *buf) {
-	return u32_show(dev, attr, buf, 0xD8);
+	return u32_show(dev, attr, buf, CORSAIRPSU_REG_OCP_MODE);
 }
 static DEVICE_ATTR_RO(ocp_mode);
 
@@ -741,32 +2883,285 @@ static DEVICE_ATTR_RO(ocp_mode);
 // 0 for hardware or 1 for software
 static ssize_t fan_control_show(struct device *dev, struct device_attribute *attr,
 								char *buf) {
-	return u32_show(dev, attr, buf, 0xF0);
+	return u32_show(dev, attr, buf, CORSAIRPSU_REG_FAN_CONTROL);
 }
 static DEVICE_ATTR_RO(fan_control);
 
+// PMBus communication, memory or logic fault (STATUS_CML)
+// 0 or 1, pollable like the hwmon alarms
+static ssize_t comms_alarm_show(struct device *dev, struct device_attribute *attr,
+								char *buf) {
+	struct corsairpsu_snapshot *s;
+
+	s = corsairpsu_update_device(dev);
+	if (IS_ERR(s)) {
+		return PTR_ERR(s);
+	}
+
+	return sprintf(buf, "%d\n", !!s->values[CORSAIRPSU_REG_STATUS_CML]);
+}
+static DEVICE_ATTR_RO(comms_alarm);
+
+// Efficiency in thousandths, power of the rails over the AC side, from the last sweep
+static ssize_t efficiency_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct corsairpsu_snapshot *s;
+	long efficiency;
+
+	s = corsairpsu_update_device(dev);
+	if (IS_ERR(s)) {
+		return PTR_ERR(s);
+	}
+	efficiency = READ_ONCE(s->efficiency);
+	if (efficiency < 0) {
+		return -ENODATA;
+	}
+
+	return sprintf(buf, "%ld\n", efficiency);
+}
+static DEVICE_ATTR_RO(efficiency);
+
+// PSU vendor, as read once identified
+static ssize_t vendor_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct corsairpsu_data *data = dev_get_drvdata(dev);
+
+	if (!smp_load_acquire(&data->ready)) {
+		return -EAGAIN;
+	}
+
+	return sprintf(buf, "%s\n", data->vendor);
+}
+static DEVICE_ATTR_RO(vendor);
+
+// PSU model, as read once identified
+static ssize_t product_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct corsairpsu_data *data = dev_get_drvdata(dev);
+
+	if (!smp_load_acquire(&data->ready)) {
+		return -EAGAIN;
+	}
+
+	return sprintf(buf, "%s\n", data->product);
+}
+static DEVICE_ATTR_RO(product);
+
+// Fan curve, "temp pwm" per line (millidegree Celsius, 0-255), empty if none
+static ssize_t fan_curve_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct corsairpsu_data *data = dev_get_drvdata(dev);
+	int i, len = 0, ret;
+
+	ret = corsairpsu_lock(data);
+	if (ret < 0) {
+		return ret;
+	}
+	for (i = 0; i < data->fan_curve_points; i++) {
+		len += sprintf(buf + len, "%ld %ld\n", data->fan_curve[i].temp, data->fan_curve[i].pwm);
+	}
+	corsairpsu_unlock(data);
+
+	return len;
+}
+
+/*
+	Up to CORSAIRPSU_CURVE_POINTS "temp pwm" pairs by increasing temperature,
+	from CORSAIRPSU_CURVE_TEMP_MIN to CORSAIRPSU_CURVE_TEMP_MAX, applied by the
+	background sampler. Writing nothing stops it, so does a write of pwm1 or
+	pwm1_enable.
+*/
+static ssize_t fan_curve_store(struct device *dev, struct device_attribute *attr,
+			       const char *buf, size_t count) {
+	struct corsairpsu_data *data = dev_get_drvdata(dev);
+	struct corsairpsu_curve_point curve[CORSAIRPSU_CURVE_POINTS];
+	unsigned int n = 0;
+	long temp, pwm;
+	int len, ret;
+
+	if (!smp_load_acquire(&data->ready)) {
+		return -EAGAIN;
+	}
+
+	while (sscanf(buf, "%ld %ld%n", &temp, &pwm, &len) == 2) {
+		if (n == CORSAIRPSU_CURVE_POINTS || pwm < 0 || pwm > 255 ||
+		    temp < CORSAIRPSU_CURVE_TEMP_MIN || temp > CORSAIRPSU_CURVE_TEMP_MAX ||
+		    (n > 0 && temp <= curve[n - 1].temp)) {
+			return -EINVAL;
+		}
+		curve[n].temp = temp;
+		curve[n].pwm = pwm;
+		n++;
+		buf += len;
+	}
+	if (*skip_spaces(buf) != '\0') {
+		return -EINVAL;
+	}
+
+	ret = corsairpsu_lock(data);
+	if (ret < 0) {
+		return ret;
+	}
+	memcpy(data->fan_curve, curve, n * sizeof(*curve));
+	data->fan_curve_points = n;
+	corsairpsu_apply_fan_curve(data);
+	corsairpsu_unlock(data);
+
+	return count;
+}
+static DEVICE_ATTR_RW(fan_curve);
+
 // custom attributes, can be read through /sys/class/hwmon/hwmon* but not 'sensors'
 static struct attribute *corsairpsu_attrs[] = {
 	&dev_attr_total_uptime.attr,
 	&dev_attr_current_uptime.attr,
 	&dev_attr_ocp_mode.attr,
 	&dev_attr_fan_control.attr,
+	&dev_attr_comms_alarm.attr,
+	&dev_attr_efficiency.attr,
+	&dev_attr_vendor.attr,
+	&dev_attr_product.attr,
+	&dev_attr_fan_curve.attr,
+	NULL
+};
+
+// hide the custom attributes of the registers the PSU doesn't answer
+static umode_t corsairpsu_attr_is_visible(struct kobject *kobj, struct attribute *attr, int n) {
+	struct corsairpsu_data *data = dev_get_drvdata(kobj_to_dev(kobj));
+	enum corsairpsu_reg_id reg;
+
+	if (attr == &dev_attr_total_uptime.attr) {
+		reg = CORSAIRPSU_REG_TOTAL_UPTIME;
+	} else if (attr == &dev_attr_current_uptime.attr) {
+		reg = CORSAIRPSU_REG_CURRENT_UPTIME;
+	} else if (attr == &dev_attr_ocp_mode.attr) {
+		reg = CORSAIRPSU_REG_OCP_MODE;
+	} else if (attr == &dev_attr_fan_control.attr) {
+		reg = CORSAIRPSU_REG_FAN_CONTROL;
+	} else if (attr == &dev_attr_comms_alarm.attr) {
+		reg = CORSAIRPSU_REG_STATUS_CML;
+	} else if (attr == &dev_attr_fan_curve.attr) {
+		reg = CORSAIRPSU_REG_FAN_PWM;
+	} else if (attr == &dev_attr_efficiency.attr) {
+		return corsairpsu_has_power_in(data) &&
+		       test_bit(CORSAIRPSU_REG_POWER_RAIL, data->supported) ? attr->mode : 0;
+	} else {
+		return attr->mode;
+	}
+
+	return test_bit(reg, data->supported) ? attr->mode : 0;
+}
+
+// all the readings of a sweep at once, as a struct corsairpsu_record
+static ssize_t snapshot_read(struct file *file, struct kobject *kobj,
+			     struct bin_attribute *attr, char *buf, loff_t off, size_t count) {
+	struct device *dev = kobj_to_dev(kobj);
+	struct corsairpsu_data *data = dev_get_drvdata(dev);
+	struct corsairpsu_snapshot *s;
+	struct corsairpsu_record record = {
+		.version = CORSAIRPSU_RECORD_VERSION,
+		.size = sizeof(record),
+	};
+	const long *v;
+	unsigned int seq;
+	int i;
+
+	s = corsairpsu_update_device(dev);
+	if (IS_ERR(s)) {
+		return PTR_ERR(s);
+	}
+	v = s->values;
+
+	do {
+		seq = read_seqcount_begin(&data->snapshot_seq);
+
+		record.timestamp = s->timestamp;
+		record.temp[0] = v[CORSAIRPSU_REG_TEMP1];
+		record.temp[1] = v[CORSAIRPSU_REG_TEMP2];
+		record.temp_max = v[CORSAIRPSU_REG_TEMP_MAX];
+		record.fan = v[CORSAIRPSU_REG_FAN];
+		record.in[0] = v[CORSAIRPSU_REG_IN_SUPPLY];
+		record.power[0] = v[CORSAIRPSU_REG_POWER_TOTAL];
+		for (i = 0; i < CORSAIRPSU_RAILS; i++) {
+			record.in[i + 1] = v[CORSAIRPSU_REG_IN_RAIL + i];
+			record.in_min[i] = v[CORSAIRPSU_REG_IN_MIN + i];
+			record.in_max[i] = v[CORSAIRPSU_REG_IN_MAX + i];
+			record.curr[i] = v[CORSAIRPSU_REG_CURR + i];
+			record.curr_max[i] = v[CORSAIRPSU_REG_CURR_MAX + i];
+			record.power[i + 1] = v[CORSAIRPSU_REG_POWER_RAIL + i];
+		}
+		record.total_uptime = v[CORSAIRPSU_REG_TOTAL_UPTIME];
+		record.current_uptime = v[CORSAIRPSU_REG_CURRENT_UPTIME];
+		record.ocp_mode = v[CORSAIRPSU_REG_OCP_MODE];
+		record.fan_control = v[CORSAIRPSU_REG_FAN_CONTROL];
+		record.curr_supply = v[CORSAIRPSU_REG_CURR_SUPPLY];
+		record.power_in = s->power_in;
+		record.efficiency = s->efficiency;
+		record.pwm = DIV_ROUND_CLOSEST(v[CORSAIRPSU_REG_FAN_PWM] * 255, 100);
+	} while (read_seqcount_retry(&data->snapshot_seq, seq));
+
+	return memory_read_from_buffer(buf, count, &off, &record, sizeof(record));
+}
+static BIN_ATTR_RO(snapshot, sizeof(struct corsairpsu_record));
+
+static struct bin_attribute *corsairpsu_bin_attrs[] = {
+	&bin_attr_snapshot,
 	NULL
 };
 
 static const struct attribute_group corsairpsu_group = {
-	.attrs = corsairpsu_attrs
+	.is_visible = corsairpsu_attr_is_visible,
+	.attrs = corsairpsu_attrs,
+	.bin_attrs = corsairpsu_bin_attrs,
 };
 __ATTRIBUTE_GROUPS(corsairpsu);
 
+/*
+	The PSU can be slow to answer, up to cmd_timeout per command and the
+	recoveries, so it is identified off the probe path. The hwmon device is
+	registered once the registers are discovered, with only the attributes
+	this model backs.
+*/
+static void corsairpsu_probe_work(struct work_struct *work) {
+	struct corsairpsu_data *data = container_of(work, struct corsairpsu_data, probe_work);
+	struct device *hwmon_dev;
+	char name[32] = { 0 };
+
+	// say hello
+	send_recv_cmd(data, 0xfe, 0x03, 0x00, name, sizeof(name)-1);
+	send_recv_cmd(data, 0x03, 0x99, 0x00, data->vendor, sizeof(data->vendor)-1);
+	send_recv_cmd(data, 0x03, 0x9a, 0x00, data->product, sizeof(data->product)-1);
+	printk(KERN_DEBUG "corsairpsu driver ready for %s, %s, %s\n", name, data->vendor, data->product);
+
+	// what this model answers decides which attributes are backed,
+	// static registers are then read once and for all, retried by the first sweep on failure
+	mutex_lock(&data->update_lock);
+	corsairpsu_discover(data);
+	corsairpsu_read_vout_modes(data);
+	corsairpsu_refresh_classes(data, BIT(CORSAIRPSU_STATIC));
+	corsairpsu_unlock(data);
+
+	// unregistered in corsairpsu_remove() before the HID I/O stops
+	hwmon_dev = hwmon_device_register_with_info(
+		&data->hdev->dev, "corsairpsu", data, &corsairpsu_chip_info, corsairpsu_groups
+	);
+	if (IS_ERR(hwmon_dev)) {
+		hid_err(data->hdev, "can't register the hwmon device (%ld)\n", PTR_ERR(hwmon_dev));
+		return;
+	}
+
+	// the attributes are -EAGAIN until then, the sweeps notify the device once set
+	mutex_lock(&data->update_lock);
+	data->hwmon_dev = hwmon_dev;
+	smp_store_release(&data->ready, true);
+	corsairpsu_unlock(data);
+
+	mutex_lock(&corsairpsu_registry_lock);
+	list_add_tail(&data->registry, &corsairpsu_registry);
+	mutex_unlock(&corsairpsu_registry_lock);
+
+	corsairpsu_set_update_interval(data, READ_ONCE(data->update_interval));
+}
+
 static int corsairpsu_probe(struct hid_device *dev, const struct hid_device_id *id) {
 	int ret;
-	struct usb_interface *usbif = to_usb_interface(dev->dev.parent);
 	struct corsairpsu_data *data;
-	struct device *hwmon_dev;
-	char name[32] = { 0 };
-	char vendor[32] = { 0 };
-	char product[32] = { 0 };
 
 	// hid device setup
 	ret = hid_parse(dev);
@@ -774,39 +3169,158 @@ static int corsairpsu_probe(struct hid_device *dev, const struct hid_device_id *
 		hid_err(dev, "hid_parse failed\n");
 		return ret;
 	}
-	ret = hid_hw_start(dev, HID_CONNECT_HIDRAW);
-	if (ret != 0) {
-		hid_err(dev, "hid_hw_start failed\n");
-		return ret;
-	}
 
 	// mem alloc
 	data = devm_kzalloc(&dev->dev, sizeof(*data), GFP_KERNEL);
 	if (data == NULL)
 		return -ENOMEM;
-	data->usbdev = interface_to_usbdev(usbif);
-	data->buf = devm_kzalloc(&dev->dev, 64, GFP_KERNEL);
-	if (data->buf == NULL)
+	data->hdev = dev;
+	mutex_init(&data->usb_mutex);
+	// devres data is DMA aligned, a report spanning whole cachelines shares none of them
+	data->tx = devm_kzalloc(&dev->dev, ALIGN(CORSAIRPSU_REPORT_SIZE, dma_get_cache_alignment()),
+				GFP_KERNEL);
+	if (data->tx == NULL)
 		return -ENOMEM;
+	data->page = CORSAIRPSU_PAGE_UNKNOWN;
+	data->stats = devm_kzalloc(&dev->dev, sizeof(*data->stats), GFP_KERNEL);
+	if (data->stats == NULL)
+		return -ENOMEM;
+	mutex_init(&data->update_lock);
+	seqcount_mutex_init(&data->snapshot_seq, &data->update_lock);
+	init_waitqueue_head(&data->update_wait);
+	INIT_DELAYED_WORK(&data->sample_work, corsairpsu_sample_work);
+	INIT_DELAYED_WORK(&data->fan_work, corsairpsu_fan_work);
+	memset(data->fan_request, -1, sizeof(data->fan_request));
+	mutex_init(&data->ring_read_lock);
+	init_waitqueue_head(&data->ring_wait);
+	// the ring only backs the debugfs samples file, the PSU is still usable without it
+	ret = kfifo_alloc(&data->ring, clamp_val(ring_size, CORSAIRPSU_RING_MIN, CORSAIRPSU_RING_MAX),
+			  GFP_KERNEL);
+	if (ret != 0) {
+		hid_warn(dev, "can't allocate the samples ring (%d)\n", ret);
+	}
+	spin_lock_init(&data->rx_lock);
+	init_completion(&data->rx_done);
+	INIT_WORK(&data->probe_work, corsairpsu_probe_work);
+	INIT_WORK(&data->aggregate_work, corsairpsu_aggregate_work);
+	INIT_LIST_HEAD(&data->registry);
+#ifdef CORSAIRPSU_MOCK
+	mutex_init(&data->bench.lock);
+#endif
+	hid_set_drvdata(dev, data);
 
-	// register hwmon device
-	hwmon_dev = devm_hwmon_device_register_with_info(
-		&dev->dev, "corsairpsu", data, &corsairpsu_chip_info, corsairpsu_groups
-	);
+	ret = hid_hw_start(dev, HID_CONNECT_HIDRAW);
+	if (ret != 0) {
+		hid_err(dev, "hid_hw_start failed\n");
+		goto err_free;
+	}
 
-	// say hello
-	send_recv_cmd(data, 0xfe, 0x03, 0x00, name, sizeof(name)-1);
-	send_recv_cmd(data, 0x03, 0x99, 0x00, vendor, sizeof(name)-1);
-	send_recv_cmd(data, 0x03, 0x9a, 0x00, product, sizeof(name)-1);
-	printk(KERN_DEBUG "corsairpsu driver ready for %s, %s, %s\n", name, vendor, product);
+	// keep the input urb running so responses reach corsairpsu_raw_event()
+	ret = hid_hw_open(dev);
+	if (ret != 0) {
+		hid_err(dev, "hid_hw_open failed\n");
+		goto err_stop;
+	}
+	hid_device_io_start(dev);
+
+	data->debugfs = debugfs_create_dir(dev_name(&dev->dev), corsairpsu_debugfs);
+	if (kfifo_initialized(&data->ring)) {
+		debugfs_create_file("samples", 0400, data->debugfs, data, &samples_fops);
+	}
+	debugfs_create_file("errors", 0444, data->debugfs, data, &errors_fops);
+	debugfs_create_file("stats", 0600, data->debugfs, data, &stats_fops);
+	debugfs_create_file("pmbus", 0600, data->debugfs, data, &pmbus_fops);
+#ifdef CORSAIRPSU_MOCK
+	debugfs_create_file("bench", 0600, data->debugfs, data, &bench_fops);
+#endif
 
-	return PTR_ERR_OR_ZERO(hwmon_dev);
+	corsairpsu_set_update_interval(data, update_interval);
+
+	queue_work(system_long_wq, &data->probe_work);
+
+	return 0;
+
+err_stop:
+	hid_hw_stop(dev);
+err_free:
+	kfifo_free(&data->ring);
+	return ret;
 }
 
 static void corsairpsu_remove(struct hid_device *dev) {
+	struct corsairpsu_data *data = hid_get_drvdata(dev);
+
+	cancel_work_sync(&data->probe_work);
+
+	// waits for an aggregate reading this PSU, if it was identified
+	mutex_lock(&corsairpsu_registry_lock);
+	list_del(&data->registry);
+	mutex_unlock(&corsairpsu_registry_lock);
+
+	// no work is queued from here, and blocked samples readers go before debugfs waits for them
+	mutex_lock(&data->update_lock);
+	WRITE_ONCE(data->removing, true);
+	corsairpsu_unlock(data);
+	wake_up_interruptible(&data->ring_wait);
+
+	// the sweeps notify the hwmon device, which has to outlive all of them
+	cancel_delayed_work_sync(&data->sample_work);
+	cancel_delayed_work_sync(&data->fan_work);
+	debugfs_remove_recursive(data->debugfs);	// waits for the bench and pmbus writers
+	if (data->hwmon_dev != NULL) {
+		hwmon_device_unregister(data->hwmon_dev);
+	}
+	kfifo_free(&data->ring);
+
+	hid_hw_close(dev);
 	hid_hw_stop(dev);
 }
 
+#ifdef CONFIG_PM
+/*
+	Stop the sampler until resume, a sweep in progress is waited for. The
+	snapshot is kept, so the static registers aren't read again.
+*/
+static int corsairpsu_suspend(struct hid_device *dev, pm_message_t message) {
+	struct corsairpsu_data *data = hid_get_drvdata(dev);
+
+	flush_work(&data->probe_work);
+	cancel_delayed_work_sync(&data->sample_work);
+	flush_delayed_work(&data->fan_work);
+
+	mutex_lock(&data->update_lock);
+	corsairpsu_unlock(data);
+
+	return 0;
+}
+
+/*
+	The PSU needs a handshake after a suspend or a USB reset, do it once here
+	rather than in the recovery of the first commands, then mark the dynamic
+	registers for the next sweep, which reads the slow ones too
+*/
+static int corsairpsu_resume(struct hid_device *dev) {
+	struct corsairpsu_data *data = hid_get_drvdata(dev);
+	int ret;
+
+	mutex_lock(&data->update_lock);
+	ret = send_recv_handshake(data);
+	if (ret < 0) {
+		hid_warn(dev, "handshake failed on resume (%d)\n", ret);
+		data->recovery = CORSAIRPSU_RECOVER_HANDSHAKE;
+	} else {
+		data->recovery = CORSAIRPSU_RECOVER_RESYNC;
+	}
+	data->valid = false;
+	data->classes_loaded &= ~BIT(CORSAIRPSU_SLOW);
+	corsairpsu_unlock(data);
+
+	corsairpsu_set_update_interval(data, data->update_interval);
+
+	return 0;
+}
+#endif
+
 static const struct hid_device_id corsairpsu_devices[] = {
 	{ HID_USB_DEVICE(USB_VENDOR_ID_CORSAIR, 0x1c0a) }, // RM650i
 	{ HID_USB_DEVICE(USB_VENDOR_ID_CORSAIR, 0x1c0b) }, // RM750i
@@ -827,6 +3341,417 @@ static struct hid_driver corsairpsu_driver = {
 	.id_table 	= corsairpsu_devices,
 	.probe 		= corsairpsu_probe,
 	.remove 	= corsairpsu_remove,
+	.raw_event 	= corsairpsu_raw_event,
+	.driver 	= {
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
+#ifdef CONFIG_PM
+	.suspend 	= corsairpsu_suspend,
+	.resume 	= corsairpsu_resume,
+	.reset_resume 	= corsairpsu_resume,
+#endif
+};
+
+#ifdef CORSAIRPSU_MOCK
+/*
+	Mock PSUs, virtual HID devices answering like an RM650i, to measure the
+	driver without the hardware. Only built by 'make mock'.
+
+	The transport ops are the HID low level driver of the device, so the driver
+	binds and runs exactly as with a PSU: output reports go to
+	corsairpsu_mock_output_report(), responses come back through
+	corsairpsu_raw_event() from a hrtimer, mock_latency us later.
+*/
+
+static unsigned int mock_devices = 1;
+module_param(mock_devices, uint, 0444);
+MODULE_PARM_DESC(mock_devices, "Number of mock PSUs to create");
+
+static unsigned int mock_latency = 1000;
+module_param(mock_latency, uint, 0644);
+MODULE_PARM_DESC(mock_latency, "Time in us the mock PSUs take to answer a command");
+
+static unsigned int mock_error_every;
+module_param(mock_error_every, uint, 0644);
+MODULE_PARM_DESC(mock_error_every, "Answer every Nth command with another opcode (0 to disable)");
+
+static unsigned int mock_drop_every;
+module_param(mock_drop_every, uint, 0644);
+MODULE_PARM_DESC(mock_drop_every, "Don't answer every Nth command (0 to disable)");
+
+#define CORSAIRPSU_MOCK_MAX		8
+#define CORSAIRPSU_MOCK_QUEUE		16	// responses in flight, more than CORSAIRPSU_PIPELINE_MAX
+#define CORSAIRPSU_MOCK_VOUT_EXPONENT	-9
+#define CORSAIRPSU_MOCK_TOTAL_UPTIME	23160895	// in s, before the module was loaded
+
+struct corsairpsu_mock_response {
+	ktime_t due;
+	u8 raw[64];
+};
+
+struct corsairpsu_mock {
+	struct hid_device *hdev;
+	struct hrtimer timer;
+	spinlock_t lock;			// protects the fields below
+	struct corsairpsu_mock_response queue[CORSAIRPSU_MOCK_QUEUE];
+	unsigned int head;			// next response to deliver
+	unsigned int count;			// responses queued
+	bool armed;				// timer started or running
+	unsigned long commands;			// received, for the error injection
+	int page;
+	u8 fan_mode;
+	u8 pwm;
+};
+
+static struct corsairpsu_mock *corsairpsu_mocks[CORSAIRPSU_MOCK_MAX];
+static ktime_t corsairpsu_mock_loaded;
+
+// vendor defined, 64 bytes input and output reports without report ID, like the PSUs
+static const u8 corsairpsu_mock_rdesc[] = {
+	0x06, 0x00, 0xff,		// Usage Page (Vendor Defined 0xFF00)
+	0x09, 0x01,			// Usage (0x01)
+	0xa1, 0x01,			// Collection (Application)
+	0x15, 0x00,			//   Logical Minimum (0)
+	0x26, 0xff, 0x00,		//   Logical Maximum (255)
+	0x75, 0x08,			//   Report Size (8)
+	0x95, 0x40,			//   Report Count (64)
+	0x09, 0x02,			//   Usage (0x02)
+	0x81, 0x02,			//   Input (Data,Var,Abs)
+	0x09, 0x03,			//   Usage (0x03)
+	0x91, 0x02,			//   Output (Data,Var,Abs)
+	0xc0,				// End Collection
+};
+
+// thousandths of a unit into LINEAR11, with the exponent keeping the most precision
+static u16 corsairpsu_mock_linear11(long milli) {
+	int exponent;
+	long mantissa = 0;
+
+	for (exponent = -10; exponent < 15; exponent++) {
+		if (exponent < 0) {
+			mantissa = milli * (1 << -exponent) / 1000;
+		} else {
+			mantissa = milli / (1 << exponent) / 1000;
+		}
+		if (mantissa >= -1024 && mantissa < 1024) {
+			break;
+		}
+	}
+
+	return ((exponent & 0x1f) << 11) | (mantissa & 0x7ff);
+}
+
+// the response of an RM650i under a light load to the command in cmd
+static void corsairpsu_mock_answer(struct corsairpsu_mock *mock, const u8 *cmd, u8 *raw) {
+	static const long vout[] = { 12050, 5020, 3310 };
+	static const long vout_max[] = { 15590, 6500, 4290 };
+	static const long vout_min[] = { 8410, 3500, 2310 };
+	static const long curr[] = { 8250, 2875, 2125 };
+	static const long curr_max[] = { 65000, 40000, 40000 };
+	static const long power[] = { 99500, 14500, 7000 };
+	int page = clamp(mock->page, 0, CORSAIRPSU_RAILS - 1);
+	u32 uptime = div_u64(ktime_to_ns(ktime_sub(ktime_get(), corsairpsu_mock_loaded)),
+			     NSEC_PER_SEC);
+
+	raw[0] = cmd[0];
+	raw[1] = cmd[1];
+
+	// handshake
+	if (cmd[0] == 0xfe) {
+		strscpy((char *)raw + 2, "RM650i", 62);
+		return;
+	}
+
+	// page select and writes
+	if (cmd[0] == 0x02) {
+		if (cmd[1] == 0x00) {
+			mock->page = cmd[2];
+		} else if (cmd[1] == 0xf0) {
+			mock->fan_mode = cmd[2];
+		} else if (cmd[1] == 0x3b) {
+			mock->pwm = cmd[2];
+		} else {
+			raw[1] = ~cmd[1];
+		}
+		return;
+	}
+
+	switch (cmd[1]) {
+	case 0x99:
+		strscpy((char *)raw + 2, "CORSAIR", 62);
+		break;
+	case 0x9a:
+		strscpy((char *)raw + 2, "RM650i", 62);
+		break;
+	case PMBUS_VOUT_MODE:
+		raw[2] = CORSAIRPSU_MOCK_VOUT_EXPONENT & 0x1f;
+		break;
+	case 0x8b:
+		put_unaligned_le16(vout[page] * (1 << -CORSAIRPSU_MOCK_VOUT_EXPONENT) / 1000, raw + 2);
+		break;
+	case 0x40:
+		put_unaligned_le16(corsairpsu_mock_linear11(vout_max[page]), raw + 2);
+		break;
+	case 0x44:
+		put_unaligned_le16(corsairpsu_mock_linear11(vout_min[page]), raw + 2);
+		break;
+	case 0x8c:
+		put_unaligned_le16(corsairpsu_mock_linear11(curr[page]), raw + 2);
+		break;
+	case 0x46:
+		put_unaligned_le16(corsairpsu_mock_linear11(curr_max[page]), raw + 2);
+		break;
+	case 0x96:
+		put_unaligned_le16(corsairpsu_mock_linear11(power[page]), raw + 2);
+		break;
+	case 0x8d:
+		put_unaligned_le16(corsairpsu_mock_linear11(45250), raw + 2);
+		break;
+	case 0x8e:
+		put_unaligned_le16(corsairpsu_mock_linear11(38000), raw + 2);
+		break;
+	case 0x4f:
+		put_unaligned_le16(corsairpsu_mock_linear11(70000), raw + 2);
+		break;
+	case 0x90:
+		put_unaligned_le16(corsairpsu_mock_linear11(mock->fan_mode ? mock->pwm * 30000 : 600000),
+				   raw + 2);
+		break;
+	case 0x3b:
+		raw[2] = mock->pwm;
+		break;
+	case 0x88:
+		put_unaligned_le16(corsairpsu_mock_linear11(230000), raw + 2);
+		break;
+	case 0x89:
+		put_unaligned_le16(corsairpsu_mock_linear11(575), raw + 2);
+		break;
+	case 0xee:
+		put_unaligned_le16(corsairpsu_mock_linear11(121000), raw + 2);
+		break;
+	case 0xd1:
+		put_unaligned_le32(CORSAIRPSU_MOCK_TOTAL_UPTIME + uptime, raw + 2);
+		break;
+	case 0xd2:
+		put_unaligned_le32(uptime, raw + 2);
+		break;
+	case 0xd8:
+		raw[2] = 1;
+		break;
+	case 0xf0:
+		raw[2] = mock->fan_mode;
+		break;
+	case 0x79:
+	case 0x7d:
+	case 0x7e:
+	case 0x81:
+		// no fault
+		break;
+	default:
+		// not supported by this model
+		raw[1] = ~cmd[1];
+		break;
+	}
+}
+
+static enum hrtimer_restart corsairpsu_mock_timer(struct hrtimer *timer) {
+	struct corsairpsu_mock *mock = container_of(timer, struct corsairpsu_mock, timer);
+	struct corsairpsu_mock_response *resp;
+	ktime_t now = ktime_get();
+	unsigned long flags;
+	u8 raw[64];
+
+	spin_lock_irqsave(&mock->lock, flags);
+	while (mock->count > 0) {
+		resp = &mock->queue[mock->head];
+		if (ktime_after(resp->due, now)) {
+			hrtimer_set_expires(timer, resp->due);
+			spin_unlock_irqrestore(&mock->lock, flags);
+			return HRTIMER_RESTART;
+		}
+		memcpy(raw, resp->raw, sizeof(raw));
+		mock->head = (mock->head + 1) % CORSAIRPSU_MOCK_QUEUE;
+		mock->count--;
+
+		// armed stays set, so responses queued meanwhile are delivered by this loop
+		spin_unlock_irqrestore(&mock->lock, flags);
+		hid_input_report(mock->hdev, HID_INPUT_REPORT, raw, sizeof(raw), 1);
+		spin_lock_irqsave(&mock->lock, flags);
+	}
+	mock->armed = false;
+	spin_unlock_irqrestore(&mock->lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+static int corsairpsu_mock_output_report(struct hid_device *hdev, u8 *buf, size_t len) {
+	struct corsairpsu_mock *mock = hdev->driver_data;
+	struct corsairpsu_mock_response *resp;
+	unsigned long flags;
+	unsigned long n;
+
+	if (len < 3)
+		return -EINVAL;
+
+	spin_lock_irqsave(&mock->lock, flags);
+	n = ++mock->commands;
+
+	// a lost response, or one the driver sent too many commands ahead for
+	if ((mock_drop_every && n % mock_drop_every == 0) || mock->count == CORSAIRPSU_MOCK_QUEUE) {
+		spin_unlock_irqrestore(&mock->lock, flags);
+		return len;
+	}
+
+	resp = &mock->queue[(mock->head + mock->count) % CORSAIRPSU_MOCK_QUEUE];
+	memset(resp->raw, 0, sizeof(resp->raw));
+	corsairpsu_mock_answer(mock, buf, resp->raw);
+	if (mock_error_every && n % mock_error_every == 0) {
+		resp->raw[1] = ~buf[1];
+	}
+	resp->due = ktime_add_us(ktime_get(), READ_ONCE(mock_latency));
+	mock->count++;
+
+	if (!mock->armed) {
+		mock->armed = true;
+		hrtimer_start(&mock->timer, resp->due, HRTIMER_MODE_ABS);
+	}
+	spin_unlock_irqrestore(&mock->lock, flags);
+
+	return len;
+}
+
+static int corsairpsu_mock_raw_request(struct hid_device *hdev, unsigned char reportnum,
+				       __u8 *buf, size_t len, unsigned char rtype, int reqtype) {
+	return -EIO;
+}
+
+static int corsairpsu_mock_parse(struct hid_device *hdev) {
+	return hid_parse_report(hdev, corsairpsu_mock_rdesc, sizeof(corsairpsu_mock_rdesc));
+}
+
+static int corsairpsu_mock_start(struct hid_device *hdev) {
+	return 0;
+}
+
+static void corsairpsu_mock_stop(struct hid_device *hdev) {
+}
+
+static int corsairpsu_mock_open(struct hid_device *hdev) {
+	return 0;
+}
+
+static void corsairpsu_mock_close(struct hid_device *hdev) {
+}
+
+static struct hid_ll_driver corsairpsu_mock_ll_driver = {
+	.parse = corsairpsu_mock_parse,
+	.start = corsairpsu_mock_start,
+	.stop = corsairpsu_mock_stop,
+	.open = corsairpsu_mock_open,
+	.close = corsairpsu_mock_close,
+	.raw_request = corsairpsu_mock_raw_request,
+	.output_report = corsairpsu_mock_output_report,
 };
 
-module_hid_driver(corsairpsu_driver);
+static int corsairpsu_mock_create(int i) {
+	struct corsairpsu_mock *mock;
+	struct hid_device *hdev;
+	int ret;
+
+	mock = kzalloc(sizeof(*mock), GFP_KERNEL);
+	if (mock == NULL)
+		return -ENOMEM;
+	spin_lock_init(&mock->lock);
+	hrtimer_init(&mock->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	mock->timer.function = corsairpsu_mock_timer;
+
+	hdev = hid_allocate_device();
+	if (IS_ERR(hdev)) {
+		kfree(mock);
+		return PTR_ERR(hdev);
+	}
+	hdev->ll_driver = &corsairpsu_mock_ll_driver;
+	hdev->driver_data = mock;
+	hdev->bus = BUS_USB;
+	hdev->vendor = USB_VENDOR_ID_CORSAIR;
+	hdev->product = 0x1c0a;
+	snprintf(hdev->name, sizeof(hdev->name), "Corsair RM650i mock %d", i);
+	snprintf(hdev->phys, sizeof(hdev->phys), "corsairpsu-mock/input%d", i);
+	mock->hdev = hdev;
+
+	// probes corsairpsu_driver
+	ret = hid_add_device(hdev);
+	if (ret != 0) {
+		hid_destroy_device(hdev);
+		kfree(mock);
+		return ret;
+	}
+
+	corsairpsu_mocks[i] = mock;
+	return 0;
+}
+
+static void corsairpsu_mock_create_all(void) {
+	int i, ret;
+
+	corsairpsu_mock_loaded = ktime_get();
+	for (i = 0; i < min(mock_devices, (unsigned int)CORSAIRPSU_MOCK_MAX); i++) {
+		ret = corsairpsu_mock_create(i);
+		if (ret < 0) {
+			printk(KERN_WARNING "corsairpsu: failed to create mock PSU %d (error %d)\n", i, ret);
+			break;
+		}
+	}
+}
+
+static void corsairpsu_mock_destroy_all(void) {
+	struct corsairpsu_mock *mock;
+	int i;
+
+	for (i = 0; i < CORSAIRPSU_MOCK_MAX; i++) {
+		mock = corsairpsu_mocks[i];
+		if (mock == NULL) {
+			continue;
+		}
+
+		// unbinds the driver, the device is kept until the timer can't deliver anymore
+		get_device(&mock->hdev->dev);
+		hid_destroy_device(mock->hdev);
+		hrtimer_cancel(&mock->timer);
+		put_device(&mock->hdev->dev);
+
+		kfree(mock);
+		corsairpsu_mocks[i] = NULL;
+	}
+}
+#endif
+
+static int __init corsairpsu_init(void) {
+	int ret;
+
+	corsairpsu_debugfs = debugfs_create_dir("corsairpsu", NULL);
+	debugfs_create_file("aggregate", 0444, corsairpsu_debugfs, NULL, &aggregate_fops);
+
+	ret = hid_register_driver(&corsairpsu_driver);
+	if (ret != 0) {
+		debugfs_remove_recursive(corsairpsu_debugfs);
+		return ret;
+	}
+
+#ifdef CORSAIRPSU_MOCK
+	corsairpsu_mock_create_all();
+#endif
+
+	return ret;
+}
+
+static void __exit corsairpsu_exit(void) {
+#ifdef CORSAIRPSU_MOCK
+	corsairpsu_mock_destroy_all();
+#endif
+	hid_unregister_driver(&corsairpsu_driver);
+	debugfs_remove_recursive(corsairpsu_debugfs);
+}
+
+module_init(corsairpsu_init);
+module_exit(corsairpsu_exit);
@@ -0,0 +1,132 @@
+/*
+ * Tracepoints of the HID driver for the Corsair RMi and HXi series of PSUs
+ *
+ * perf list 'corsairpsu:*'
+ * echo 1 > /sys/kernel/tracing/events/corsairpsu/enable
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM corsairpsu
+
+#if !defined(_CORSAIRPSU_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CORSAIRPSU_TRACE_H
+
+#include <linux/hid.h>
+#include <linux/tracepoint.h>
+
+#define CORSAIRPSU_TRACE_DEV_LEN	24	// "0003:1B1C:1C0A.0003"
+
+// a command sent to the PSU, on the selected page
+TRACE_EVENT(corsairpsu_cmd_start,
+	TP_PROTO(struct hid_device *hdev, u8 addr, u8 opcode, int page),
+
+	TP_ARGS(hdev, addr, opcode, page),
+
+	TP_STRUCT__entry(
+		__array(char, dev, CORSAIRPSU_TRACE_DEV_LEN)
+		__field(u8, addr)
+		__field(u8, opcode)
+		__field(int, page)
+	),
+
+	TP_fast_assign(
+		strscpy(__entry->dev, dev_name(&hdev->dev), CORSAIRPSU_TRACE_DEV_LEN);
+		__entry->addr = addr;
+		__entry->opcode = opcode;
+		__entry->page = page;
+	),
+
+	TP_printk("%s addr=0x%02x opcode=0x%02x page=%d",
+		  __entry->dev, __entry->addr, __entry->opcode, __entry->page)
+);
+
+// the response to a command, status -ENODATA for another opcode, -ETIMEDOUT for none
+TRACE_EVENT(corsairpsu_cmd_done,
+	TP_PROTO(struct hid_device *hdev, u8 opcode, int page, s64 latency, int status),
+
+	TP_ARGS(hdev, opcode, page, latency, status),
+
+	TP_STRUCT__entry(
+		__array(char, dev, CORSAIRPSU_TRACE_DEV_LEN)
+		__field(u8, opcode)
+		__field(int, page)
+		__field(s64, latency)
+		__field(int, status)
+	),
+
+	TP_fast_assign(
+		strscpy(__entry->dev, dev_name(&hdev->dev), CORSAIRPSU_TRACE_DEV_LEN);
+		__entry->opcode = opcode;
+		__entry->page = page;
+		__entry->latency = latency;
+		__entry->status = status;
+	),
+
+	TP_printk("%s opcode=0x%02x page=%d latency=%lldns status=%d",
+		  __entry->dev, __entry->opcode, __entry->page, __entry->latency,
+		  __entry->status)
+);
+
+// a command retried after a resync (level 0) or a handshake (level 1)
+TRACE_EVENT(corsairpsu_handshake_retry,
+	TP_PROTO(struct hid_device *hdev, u8 opcode, int page, int level),
+
+	TP_ARGS(hdev, opcode, page, level),
+
+	TP_STRUCT__entry(
+		__array(char, dev, CORSAIRPSU_TRACE_DEV_LEN)
+		__field(u8, opcode)
+		__field(int, page)
+		__field(int, level)
+	),
+
+	TP_fast_assign(
+		strscpy(__entry->dev, dev_name(&hdev->dev), CORSAIRPSU_TRACE_DEV_LEN);
+		__entry->opcode = opcode;
+		__entry->page = page;
+		__entry->level = level;
+	),
+
+	TP_printk("%s opcode=0x%02x page=%d level=%s",
+		  __entry->dev, __entry->opcode, __entry->page,
+		  __entry->level ? "handshake" : "resync")
+);
+
+// a sweep of the register classes mask into the snapshot
+TRACE_EVENT(corsairpsu_sweep,
+	TP_PROTO(struct hid_device *hdev, unsigned int classes, s64 duration, int ret),
+
+	TP_ARGS(hdev, classes, duration, ret),
+
+	TP_STRUCT__entry(
+		__array(char, dev, CORSAIRPSU_TRACE_DEV_LEN)
+		__field(unsigned int, classes)
+		__field(s64, duration)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		strscpy(__entry->dev, dev_name(&hdev->dev), CORSAIRPSU_TRACE_DEV_LEN);
+		__entry->classes = classes;
+		__entry->duration = duration;
+		__entry->ret = ret;
+	),
+
+	TP_printk("%s classes=0x%x duration=%lldns ret=%d",
+		  __entry->dev, __entry->classes, __entry->duration, __entry->ret)
+);
+
+#endif /* _CORSAIRPSU_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE corsairpsu_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,382 @@
+/*
+ * Read latency benchmark of the corsairpsu hwmon attributes
+ *
+ * make bench
+ * sudo tools/corsairpsu-bench -t 8
+ *
+ * Times a cold (cache expired) then warm reads of every readable attribute of
+ * the corsairpsu hwmon device, then reads them all from 1 to N concurrent
+ * threads, and reports the latency percentiles and the errors per errno
+ * (EBUSY when the sweep lock can't be taken, ETIMEDOUT, EIO...).
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HWMON_CLASS	"/sys/class/hwmon"
+#define CACHE_TIMEOUT	"/sys/module/corsairpsu/parameters/cache_timeout"
+#define MAX_ATTRS	128
+#define MAX_ERRNO	256
+
+struct attr {
+	char name[256];
+	char path[512];
+};
+
+// one run of reader threads
+struct run {
+	int iterations;
+	long long *latencies;			// in ns, iterations * nattrs per thread
+	long errors[MAX_ERRNO];
+	pthread_mutex_t lock;			// protects errors
+};
+
+struct reader {
+	pthread_t thread;
+	struct run *run;
+	long long *latencies;
+};
+
+static struct attr attrs[MAX_ATTRS];
+static int nattrs;
+
+static long long now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int read_file(const char *path, char *buf, size_t len) {
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	n = read(fd, buf, len - 1);
+	if (n < 0) {
+		n = -errno;
+		close(fd);
+		return n;
+	}
+	buf[n] = '\0';
+
+	close(fd);
+	return 0;
+}
+
+// the hwmon directory named corsairpsu, the first one if there are several PSUs
+static int find_hwmon(char *dir, size_t len) {
+	struct dirent *ent;
+	char path[512], name[64];
+	DIR *d;
+
+	d = opendir(HWMON_CLASS);
+	if (d == NULL)
+		return -errno;
+
+	while ((ent = readdir(d)) != NULL) {
+		if (strncmp(ent->d_name, "hwmon", 5) != 0) {
+			continue;
+		}
+		snprintf(path, sizeof(path), HWMON_CLASS "/%s/name", ent->d_name);
+		if (read_file(path, name, sizeof(name)) < 0) {
+			continue;
+		}
+		if (strcmp(name, "corsairpsu\n") == 0) {
+			snprintf(dir, len, HWMON_CLASS "/%s", ent->d_name);
+			closedir(d);
+			return 0;
+		}
+	}
+
+	closedir(d);
+	return -ENODEV;
+}
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(((const struct attr *)a)->name, ((const struct attr *)b)->name);
+}
+
+/*
+	The readable attributes the driver registered, from corsairpsu_info[] and
+	corsairpsu_attrs[], as they are visible for this PSU
+*/
+static int find_attrs(const char *dir) {
+	struct dirent *ent;
+	struct stat st;
+	DIR *d;
+
+	d = opendir(dir);
+	if (d == NULL)
+		return -errno;
+
+	while ((ent = readdir(d)) != NULL && nattrs < MAX_ATTRS) {
+		struct attr *attr = &attrs[nattrs];
+
+		if (strcmp(ent->d_name, "name") == 0 || strcmp(ent->d_name, "uevent") == 0 ||
+		    strcmp(ent->d_name, "snapshot") == 0) {
+			continue;
+		}
+		snprintf(attr->path, sizeof(attr->path), "%s/%s", dir, ent->d_name);
+		if (lstat(attr->path, &st) < 0 || !S_ISREG(st.st_mode) || !(st.st_mode & S_IRUSR)) {
+			continue;
+		}
+		snprintf(attr->name, sizeof(attr->name), "%s", ent->d_name);
+		nattrs++;
+	}
+
+	closedir(d);
+	qsort(attrs, nattrs, sizeof(*attrs), compare_names);
+	return nattrs > 0 ? 0 : -ENOENT;
+}
+
+// a sysfs read as sensors does it, the attribute shown again at offset 0
+static int read_attr(int fd, long long *latency) {
+	char buf[64];
+	long long start;
+	ssize_t n;
+
+	start = now_ns();
+	n = pread(fd, buf, sizeof(buf), 0);
+	*latency = now_ns() - start;
+
+	return n < 0 ? -errno : 0;
+}
+
+static int compare_latencies(const void *a, const void *b) {
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// percentile p of n sorted latencies, in us
+static double percentile(const long long *latencies, long n, double p) {
+	long i = (long)(p * (n - 1) / 100 + 0.5);
+
+	return n > 0 ? latencies[i] / 1000.0 : 0;
+}
+
+static unsigned int cache_timeout(void) {
+	char buf[32];
+
+	if (read_file(CACHE_TIMEOUT, buf, sizeof(buf)) < 0)
+		return 1000;
+
+	return strtoul(buf, NULL, 10);
+}
+
+/*
+	Per attribute, a cold read once the snapshot expired, then warm reads
+	served from the cache
+*/
+static void bench_attrs(int warm) {
+	long long *latencies = calloc(warm, sizeof(*latencies));
+	unsigned int timeout = cache_timeout();
+	long long cold;
+	int i, j, fd, ret, errors;
+
+	if (latencies == NULL)
+		return;
+
+	printf("%-28s %10s %10s %10s %7s\n", "attribute", "cold us", "warm p50", "warm p99", "errors");
+	for (i = 0; i < nattrs; i++) {
+		fd = open(attrs[i].path, O_RDONLY);
+		if (fd < 0) {
+			printf("%-28s %s\n", attrs[i].name, strerror(errno));
+			continue;
+		}
+
+		errors = 0;
+		usleep((timeout + 50) * 1000);
+		if (read_attr(fd, &cold) < 0) {
+			errors++;
+		}
+		for (j = 0; j < warm; j++) {
+			ret = read_attr(fd, &latencies[j]);
+			if (ret < 0) {
+				errors++;
+			}
+		}
+		close(fd);
+
+		qsort(latencies, warm, sizeof(*latencies), compare_latencies);
+		printf("%-28s %10.1f %10.1f %10.1f %7d\n", attrs[i].name, cold / 1000.0,
+		       percentile(latencies, warm, 50), percentile(latencies, warm, 99), errors);
+	}
+
+	free(latencies);
+}
+
+static void *reader_main(void *arg) {
+	struct reader *reader = arg;
+	struct run *run = reader->run;
+	long long *latency = reader->latencies;
+	int fds[MAX_ATTRS];
+	int i, j, ret;
+
+	for (j = 0; j < nattrs; j++) {
+		fds[j] = open(attrs[j].path, O_RDONLY);
+	}
+
+	for (i = 0; i < run->iterations; i++) {
+		for (j = 0; j < nattrs; j++) {
+			ret = fds[j] < 0 ? -EBADF : read_attr(fds[j], latency);
+			latency++;
+			if (ret < 0) {
+				pthread_mutex_lock(&run->lock);
+				run->errors[-ret < MAX_ERRNO ? -ret : 0]++;
+				pthread_mutex_unlock(&run->lock);
+			}
+		}
+	}
+
+	for (j = 0; j < nattrs; j++) {
+		if (fds[j] >= 0) {
+			close(fds[j]);
+		}
+	}
+
+	return NULL;
+}
+
+// threads concurrent readers, each reading every attribute iterations times
+static int bench_readers(int threads, int iterations) {
+	struct reader *readers = calloc(threads, sizeof(*readers));
+	struct run run = { .iterations = iterations };
+	long n = (long)threads * iterations * nattrs;
+	long errors = 0;
+	long long start, duration;
+	int i;
+
+	run.latencies = calloc(n, sizeof(*run.latencies));
+	if (readers == NULL || run.latencies == NULL) {
+		free(readers);
+		free(run.latencies);
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&run.lock, NULL);
+
+	start = now_ns();
+	for (i = 0; i < threads; i++) {
+		readers[i].run = &run;
+		readers[i].latencies = run.latencies + (long)i * iterations * nattrs;
+		pthread_create(&readers[i].thread, NULL, reader_main, &readers[i]);
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(readers[i].thread, NULL);
+	}
+	duration = now_ns() - start;
+
+	qsort(run.latencies, n, sizeof(*run.latencies), compare_latencies);
+	for (i = 0; i < MAX_ERRNO; i++) {
+		errors += run.errors[i];
+	}
+
+	printf("%7d %9ld %10.0f %10.1f %10.1f %10.1f %7ld %6.2f%%", threads, n,
+	       n * 1e9 / duration, percentile(run.latencies, n, 50),
+	       percentile(run.latencies, n, 99), run.latencies[n - 1] / 1000.0,
+	       errors, errors * 100.0 / n);
+	for (i = 0; i < MAX_ERRNO; i++) {
+		if (run.errors[i] > 0) {
+			printf(" %s %ld", i ? strerror(i) : "other", run.errors[i]);
+		}
+	}
+	printf("\n");
+
+	pthread_mutex_destroy(&run.lock);
+	free(run.latencies);
+	free(readers);
+	return 0;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr,
+		"usage: %s [-d hwmon dir] [-t threads] [-n iterations] [-w warm reads] [-C]\n"
+		"  -d  hwmon directory, the corsairpsu one by default\n"
+		"  -t  run with 1 to this many concurrent readers (4)\n"
+		"  -n  reads of every attribute per reader (100)\n"
+		"  -w  warm reads per attribute (100)\n"
+		"  -C  skip the cold and warm reads per attribute\n", prog);
+}
+
+int main(int argc, char **argv) {
+	char dir[512] = { 0 };
+	int threads = 4, iterations = 100, warm = 100, cold = 1;
+	int opt, ret, t;
+
+	while ((opt = getopt(argc, argv, "d:t:n:w:Ch")) != -1) {
+		switch (opt) {
+		case 'd':
+			snprintf(dir, sizeof(dir), "%s", optarg);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'w':
+			warm = atoi(optarg);
+			break;
+		case 'C':
+			cold = 0;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 2;
+		}
+	}
+	if (threads < 1 || iterations < 1 || warm < 1) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	if (dir[0] == '\0') {
+		ret = find_hwmon(dir, sizeof(dir));
+		if (ret < 0) {
+			fprintf(stderr, "no corsairpsu hwmon device: %s\n", strerror(-ret));
+			return 1;
+		}
+	}
+	ret = find_attrs(dir);
+	if (ret < 0) {
+		fprintf(stderr, "no attributes in %s: %s\n", dir, strerror(-ret));
+		return 1;
+	}
+	printf("%s, %d attributes, cache_timeout %u ms\n\n", dir, nattrs, cache_timeout());
+
+	if (cold) {
+		bench_attrs(warm);
+		printf("\n");
+	}
+
+	printf("%7s %9s %10s %10s %10s %10s %7s %7s\n", "readers", "reads", "reads/s",
+	       "p50 us", "p99 us", "max us", "errors", "rate");
+	for (t = 1; t <= threads; t++) {
+		ret = bench_readers(t, iterations);
+		if (ret < 0) {
+			fprintf(stderr, "%d readers: %s\n", t, strerror(-ret));
+			return 1;
+		}
+	}
+
+	return 0;
+}